@@ -0,0 +1,101 @@
+/*******************************************************
+ * Benchmarks -- header file                           *
+ *                                                     *
+ * Authors: Ferry Timmers                              *
+ *                                                     *
+ * Date: 14:02 17-10-2026                              *
+ *                                                     *
+ * Description: Minimal timing harness for headless    *
+ *              micro-benchmarks of the simulation     *
+ *******************************************************/
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <chrono>
+#include <vector>
+
+#include "../src/sim.h"
+#include "../src/forces.h"
+#include "../src/integrators.h"
+
+namespace Bench {
+
+//------------------------------------------------------------------------------
+
+typedef void (*Function)();
+
+struct Case
+{
+	const char *name;
+	Function func;
+	
+	Case(const char *name, Function func); // Registers the case
+};
+
+std::vector<Case *> &cases();
+
+#define BENCHMARK(name) \
+	static void bench_##name(); \
+	static Bench::Case case_##name(#name, bench_##name); \
+	static void bench_##name()
+
+//------------------------------------------------------------------------------
+
+/** Runs f repeatedly for at least the given time, returns seconds per call */
+template <typename F> double measure(F f, double seconds = 0.25)
+{
+	typedef std::chrono::steady_clock clock;
+	f(); // Warm up
+	long n = 0;
+	clock::time_point start = clock::now();
+	double elapsed;
+	do
+	{
+		f();
+		++n;
+		elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	}
+	while (elapsed < seconds);
+	return elapsed / n;
+}
+
+void report(const char *what, double seconds);
+void report(const char *what, double seconds, double baseline);
+
+//------------------------------------------------------------------------------
+
+/** Prevents the optimiser from discarding a computed value */
+template <typename T> inline void keep(const T &value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+//------------------------------------------------------------------------------
+// Simulation fixtures
+
+/** Exposes the protected state and force functions of the simulation */
+class Probe : public Sim::Integrator
+{
+public:
+	Probe(Sim::Simulation &sim) : Integrator(sim) {}
+	void integrate(Base::unit) {}
+	Sim::ParticleSystem &particles() { return system; }
+	void save() { saveState(); }
+	void restore() { restoreState(); }
+	void forces() { calcForces(); }
+};
+
+/** The demo cloth: n x n particles on a 0.5 wide sheet, tied by springs of
+    stiffness ks and damping kd, in a network (returned) or as Spring entities.
+    A hung cloth is glued at two corners and pulled down by gravity. */
+Sim::SpringNetwork *cloth(Sim::Simulation &sim, int n, Base::unit ks, Base::unit kd,
+	bool network = true, bool hung = true);
+
+//------------------------------------------------------------------------------
+
+} /* namespace Bench */
+
+#endif /* _BENCH_H */
+
+//..............................................................................
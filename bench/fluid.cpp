@@ -0,0 +1,475 @@
+/*******************************************************
+ * Fluid benchmarks                                    *
+ *                                                     *
+ * Time per fluid step at several grid sizes, and the  *
+ * state the pressure solve leaves behind.             *
+ *******************************************************/
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#include "bench.h"
+#include "../src/sim.h"
+#include "../src/fluid.h"
+
+using namespace Sim;
+
+namespace {
+
+//------------------------------------------------------------------------------
+
+const struct { int w, h; } sizes[] = {{80, 60}, {320, 240}, {512, 512}};
+
+/** One step, stirring fluid into the centre of the grid */
+void stir(Fluid &fluid)
+{
+	fluid.mouse.pos = Vec(0.5, 0.5);
+	fluid.mouse.v = Vec(1000.0, 500.0);
+	fluid.mouse.d = 1000.0;
+	fluid.act(0.001);
+}
+
+double step(Fluid &fluid, int warmup = 10)
+{
+	for (int i = 0; i < warmup; ++i)
+		stir(fluid);
+	return Bench::measure([&fluid]() { stir(fluid); });
+}
+
+} /* namespace */
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_solvers)
+{
+	Simulation sim("bench");
+	for (auto &s : sizes)
+	{
+		printf("  %dx%d\n", s.w, s.h);
+		double t = 0.0;
+		for (int k = 0; k < 3; ++k)
+		{
+			Fluid fluid(&sim, s.w, s.h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+			if (k == 1)
+				fluid.setSolver(new MultigridSolver(s.w, s.h));
+			if (k == 2)
+				fluid.setSolver(new ConjugateGradientSolver(s.w, s.h));
+			double time = step(fluid);
+			char what[64];
+			snprintf(what, sizeof(what), "%s (%d it, res %.1e)", fluid.solver->name(),
+				fluid.pressure.iterations, fluid.pressure.residual);
+			if (k)
+				Bench::report(what, time, t);
+			else
+				Bench::report(what, t = time);
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_traffic)
+{
+	// Grid memory the kernels outside the solver stream per step, against the
+	// time the whole step takes with the multigrid solver
+	Simulation sim("bench");
+	for (auto &s : sizes)
+	{
+		Fluid fluid(&sim, s.w, s.h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+		fluid.setSolver(new MultigridSolver(s.w, s.h));
+		double time = step(fluid);
+		const double bytes = fluid.traffic;
+		char what[64];
+		snprintf(what, sizeof(what), "%dx%d (%.1f MB, %.0f B/cell, %.1f GB/s)", s.w, s.h,
+			bytes / 1e6, bytes / (s.w * s.h), bytes / time / 1e9);
+		Bench::report(what, time);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_warm_start)
+{
+	// Pressure solves from zero and from the last step's pressure, over the
+	// same stirred run; Gauss-Seidel runs its fixed sweeps either way
+	const int w = 160, h = 120, steps = 100;
+	Simulation sim("bench");
+	for (int k = 0; k < 4; ++k)
+	{
+		double t = 0.0;
+		for (bool warm : {false, true})
+		{
+			Fluid fluid(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+			if (k == 1)
+				fluid.setSolver(new RedBlackSolver(w, h));
+			if (k == 2)
+				fluid.setSolver(new MultigridSolver(w, h));
+			if (k == 3)
+				fluid.setSolver(new ConjugateGradientSolver(w, h));
+			fluid.warm = warm;
+			
+			// The state changes every step, so time one run rather than repeats
+			typedef std::chrono::steady_clock clock;
+			clock::time_point start = clock::now();
+			int iterations = 0;
+			unit residual = 0.0;
+			for (int n = 0; n < steps; ++n)
+			{
+				stir(fluid);
+				iterations += fluid.pressure.iterations;
+				residual += fluid.pressure.residual;
+			}
+			double time = std::chrono::duration<double>(clock::now() - start).count();
+			
+			char what[64];
+			snprintf(what, sizeof(what), "%s, %s (%.1f it, res %.1e)", fluid.solver->name(),
+				warm ? "warm" : "cold", (double) iterations / steps, residual / steps);
+			if (warm)
+				Bench::report(what, time / steps, t);
+			else
+				Bench::report(what, t = time / steps);
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_grid)
+{
+	const struct { int w, h; } sizes[] = {{80, 60}, {320, 240}, {1024, 768}};
+	Simulation sim("bench");
+	for (auto &s : sizes)
+	{
+		Fluid fluid(&sim, s.w, s.h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+		fluid.setSolver(new GaussSeidelSolver(s.w, s.h));
+		char what[64];
+		snprintf(what, sizeof(what), "%dx%d step", s.w, s.h);
+		Bench::report(what, step(fluid, 2));
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_advect)
+{
+	// One solver sweep per solve, so that advection dominates the step
+	const int w = 320, h = 240;
+	Simulation sim("bench");
+	Fluid scalar(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	Fluid simd(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	scalar.setSolver(new GaussSeidelSolver(w, h, 1));
+	simd.setSolver(new GaussSeidelSolver(w, h, 1));
+	
+	unit diff = 0.0, peak = 0.0;
+	for (int k = 0; k < 20; ++k)
+	{
+		Fluid::Vectorised = false;
+		stir(scalar);
+		Fluid::Vectorised = true;
+		stir(simd);
+	}
+	for (int i = 0; i < (w + 2) * (h + 2); ++i)
+	{
+		diff = std::max(diff, (unit) fabs(scalar.d[i] - simd.d[i]));
+		peak = std::max(peak, (unit) fabs(scalar.d[i]));
+	}
+	printf("  %dx%d, largest density difference after 20 steps: %.1e (of %.1e)\n",
+		w, h, diff, peak);
+	
+	Fluid::Vectorised = false;
+	double t = step(scalar, 0);
+	Bench::report("scalar", t);
+	Fluid::Vectorised = true;
+	Bench::report("vectorised", step(simd, 0), t);
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_staggered)
+{
+	// Divergence left in the cell velocities, relative to their magnitude,
+	// each measured with the discretisation its projection uses
+	Simulation sim("bench");
+	for (auto &s : sizes)
+	{
+		printf("  %dx%d\n", s.w, s.h);
+		double t = 0.0;
+		for (int mac = 0; mac < 2; ++mac)
+		{
+			Fluid fluid(&sim, s.w, s.h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+			fluid.setStaggered(mac);
+			double time = step(fluid);
+			
+			const int w = s.w;
+			unit div = 0.0, norm = 0.0;
+			for (int j = 1; j <= s.h; ++j)
+				for (int i = 1; i <= s.w; ++i)
+				{
+					const int n = i + (w + 2) * j;
+					unit d = mac
+						? s.w * (fluid.uf[n] - fluid.uf[n - 1]) + s.h * (fluid.vf[n] - fluid.vf[n - w - 2])
+						: 0.5 * s.w * (fluid.u[n + 1] - fluid.u[n - 1])
+							+ 0.5 * s.h * (fluid.v[n + w + 2] - fluid.v[n - w - 2]);
+					div += d * d;
+					norm += s.w * s.w * fluid.u[n] * fluid.u[n] + s.h * s.h * fluid.v[n] * fluid.v[n];
+				}
+			char what[64];
+			snprintf(what, sizeof(what), "%s (divergence %.1e)", mac ? "staggered" : "collocated",
+				sqrt(div / norm));
+			if (t > 0.0)
+				Bench::report(what, time, t);
+			else
+				Bench::report(what, t = time);
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_sparse)
+{
+	// Fluid poured in near a corner of a large, otherwise empty grid
+	const int w = 320, h = 240, steps = 200;
+	Simulation sim("bench");
+	Fluid dense(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	Fluid sparse(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	sparse.sparse = true;
+	dense.warm = false; // As the sparse solves, so the results compare
+	
+	double t = 0.0;
+	for (Fluid *fluid : {&dense, &sparse})
+	{
+		// The state changes every step, so time one run rather than repeats
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		for (int k = 0; k < steps; ++k)
+		{
+			fluid->mouse.pos = Vec(0.2, 0.8);
+			fluid->mouse.v = Vec(300.0, -100.0);
+			fluid->mouse.d = 300.0;
+			fluid->act(0.001);
+		}
+		double time = std::chrono::duration<double>(clock::now() - start).count();
+		
+		size_t cells = 0;
+		for (const Span &s : fluid->active)
+			cells += s.end - s.begin;
+		char what[64];
+		snprintf(what, sizeof(what), "%s (%.0f%% active)", fluid->sparse ? "sparse" : "dense",
+			100.0 * cells / (w * h));
+		if (t > 0.0)
+			Bench::report(what, time / steps, t);
+		else
+			Bench::report(what, t = time / steps);
+	}
+	
+	unit diff = 0.0, mass = 0.0;
+	for (int i = 0; i < (w + 2) * (h + 2); ++i)
+	{
+		diff += fabs(dense.d[i] - sparse.d[i]);
+		mass += fabs(dense.d[i]);
+	}
+	printf("  %d steps at %dx%d, density difference %.1e (L1, relative)\n", steps, w, h,
+		diff / mass);
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_nested)
+{
+	// A band of fluid carried round a vortex past a small box: a coarse grid,
+	// the same grid refined around the box and also around the core of the
+	// vortex, and a uniform grid as fine as the refinement, all solved to the
+	// same tolerance. Then the same flow past two boxes far apart, which should
+	// get a patch each rather than one over both.
+	const int w = 80, h = 60, steps = 100;
+	Simulation sim("bench"), apart("bench");
+	sim.addRigid<RigidBox>(0.05, Vec(0.5, 0.25), 0.3, 1.0);
+	apart.addRigid<RigidBox>(0.05, Vec(0.25, 0.2), 0.3, 1.0);
+	apart.addRigid<RigidBox>(0.05, Vec(0.75, 0.8), 0.3, 1.0);
+	Fluid coarse(&sim, w, h, 0.0001, 0.000001, Vec(), 5.0);
+	Fluid box(&sim, w, h, 0.0001, 0.000001, Vec(), 5.0);
+	Fluid vortex(&sim, w, h, 0.0001, 0.000001, Vec(), 5.0);
+	Fluid fine(&sim, 2 * w, 2 * h, 0.0001, 0.000001, Vec(), 5.0);
+	Fluid boxes(&apart, w, h, 0.0001, 0.000001, Vec(), 5.0);
+	box.refine = vortex.refine = boxes.refine = 2;
+	vortex.curl = 1.5;
+	Fluid *fluids[] = {&coarse, &box, &vortex, &fine, &boxes};
+	const char *names[] = {"coarse", "refined at the box", "at box and vortex", "fine",
+		"refined at two boxes apart"};
+	
+	double t = 0.0;
+	for (int k = 0; k < 5; ++k)
+	{
+		Fluid *fluid = fluids[k];
+		fluid->setSolver(new MultigridSolver(fluid->width, fluid->height));
+		fluid->mouse.pos = Vec();
+		fluid->mouse.v = Vec();
+		fluid->mouse.d = 0.0;
+		for (int j = 0; j <= fluid->height + 1; ++j)
+			for (int i = 0; i <= fluid->width + 1; ++i)
+			{
+				const int n = i + (fluid->width + 2) * j;
+				const unit x = (unit) i / fluid->width, y = (unit) j / fluid->height;
+				fluid->u[n] = 0.3 * sin(Pi * x) * cos(Pi * y);
+				fluid->v[n] = -0.3 * cos(Pi * x) * sin(Pi * y);
+				fluid->d[n] = x > 0.15 && x < 0.35 && y > 0.1 && y < 0.4 ? 1.0 : 0.0;
+			}
+		
+		// The state changes every step, so time one run rather than repeats
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		for (int k = 0; k < steps; ++k)
+			fluid->act(0.001);
+		double time = std::chrono::duration<double>(clock::now() - start).count();
+		
+		int cells = fluid->width * fluid->height;
+		for (const Fluid *patch : fluid->patches)
+			cells += patch->width * patch->height;
+		char what[64];
+		snprintf(what, sizeof(what), "%s (%d cells)", names[k], cells);
+		if (t > 0.0)
+			Bench::report(what, time / steps, t);
+		else
+			Bench::report(what, t = time / steps);
+	}
+	
+	// Against the fine grid at the centres of the coarse cells
+	for (int k = 0; k < 3; ++k)
+	{
+		unit diff = 0.0, mass = 0.0;
+		for (int j = 1; j <= h; ++j)
+			for (int i = 1; i <= w; ++i)
+			{
+				const unit d = fine.d[2 * i + (2 * w + 2) * 2 * j];
+				diff += fabs(fluids[k]->d[i + (w + 2) * j] - d);
+				mass += fabs(d);
+			}
+		printf("  %s: density difference %.1e (L1, relative)\n", names[k], diff / mass);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_obstacles)
+{
+	// A cloth of thousands of quads in the fluid, held still and waving, against
+	// the same fluid without it; multigrid, so the obstacles are not lost in the
+	// pressure solve
+	const int w = 160, h = 120, n = 100;
+	Simulation sim("bench");
+	std::vector<ParticleBase *> grid;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+			grid.push_back(sim.addParticle(Vec(0.25 + 0.5 * i / n, 0.25 + 0.5 * j / n)));
+	Fluid empty(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	empty.setSolver(new MultigridSolver(w, h));
+	double t = step(empty);
+	Bench::report("no obstacles", t);
+	
+	for (int i = 0; i + 1 < n; ++i)
+		for (int j = 0; j + 1 < n; ++j)
+			sim.create<Quad>(grid[i * n + j], grid[(i + 1) * n + j],
+				grid[(i + 1) * n + j + 1], grid[i * n + j + 1]);
+	Fluid fluid(&sim, w, h, 0.0001, 0.000001, Vec(0, -10.0), 5.0);
+	fluid.setSolver(new MultigridSolver(w, h));
+	char what[64];
+	snprintf(what, sizeof(what), "%d quads, still", (n - 1) * (n - 1));
+	Bench::report(what, step(fluid), t);
+	
+	int k = 0;
+	snprintf(what, sizeof(what), "%d quads, waving", (n - 1) * (n - 1));
+	Bench::report(what, Bench::measure([&]()
+	{
+		++k;
+		for (int i = 0; i < n; ++i)
+			for (int j = 0; j < n; ++j)
+				*grid[i * n + j]->x = Vec(0.25 + 0.5 * i / n + 0.05 * sin(0.1 * k + 0.2 * j),
+					0.25 + 0.5 * j / n + 0.03 * cos(0.13 * k + 0.3 * i));
+		stir(fluid);
+	}), t);
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(fluid_viscous)
+{
+	const int w = 160, h = 120;
+	Simulation sim("bench");
+	LinearSolver *solvers[] = {
+		new GaussSeidelSolver(w, h, 1000, 1e-4),
+		new MultigridSolver(w, h, 1e-4),
+		new ConjugateGradientSolver(w, h, 1e-4)};
+	double t = 0.0;
+	for (LinearSolver *solver : solvers)
+	{
+		Fluid fluid(&sim, w, h, 0.01, 0.001, Vec(0, -10.0), 5.0);
+		fluid.setSolver(solver);
+		double time = step(fluid, 3);
+		char what[64];
+		snprintf(what, sizeof(what), "%s (diffusion %d it, res %.1e)", solver->name(),
+			solver->stats.iterations, solver->stats.residual);
+		if (t > 0.0)
+			Bench::report(what, time, t);
+		else
+			Bench::report(what, t = time);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(solver_convergence)
+{
+	// Pressure system for a lumpy divergence field, solved cold from zero
+	const int w = 80, h = 60;
+	const size_t size = (w + 2) * (h + 2);
+	std::vector<real> x0(size, 0.0), x(size);
+	unit mean = 0.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			mean += x0[i + (w + 2) * j] = sin(0.2 * i) * cos(0.3 * j)
+				+ (i < w / 3 ? 0.5 : 0.0);
+	mean /= w * h;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			x0[i + (w + 2) * j] -= mean;
+	
+	const unit tol = 1e-4;
+	printf("  %dx%d pressure, to relative residual %g\n", w, h, tol);
+	double t = 0.0;
+	for (int k = 0; k < 5; ++k)
+	{
+		// A fresh solver per solve so none of them can warm start
+		LinearSolver::Stats stats;
+		const char *name = "";
+		double time = Bench::measure([&]()
+		{
+			LinearSolver *solver = 0;
+			switch (k)
+			{
+				case 0: solver = new GaussSeidelSolver(w, h, 100000, tol); break;
+				case 1: solver = new RedBlackSolver(w, h, 1.0, tol, 100000); break;
+				case 2: solver = new RedBlackSolver(w, h, 0.0, tol, 100000); break;
+				case 3: solver = new MultigridSolver(w, h, tol); break;
+				case 4: solver = new ConjugateGradientSolver(w, h, tol); break;
+			}
+			std::fill(x.begin(), x.end(), 0.0);
+			solver->solve(0, x.data(), x0.data(), 1.0, 4.0);
+			stats = solver->stats;
+			name = solver->name();
+			delete solver;
+		});
+		char what[64];
+		snprintf(what, sizeof(what), "%s%s (%d it, %.0f/s)", name,
+			k == 1 ? " w=1" : "", stats.iterations, -log10(tol) / time);
+		if (t > 0.0)
+			Bench::report(what, time, t);
+		else
+			Bench::report(what, t = time);
+	}
+	printf("  (n/s: orders of magnitude of residual reduction per second)\n");
+}
+
+//..............................................................................
@@ -0,0 +1,190 @@
+/*******************************************************
+ * Integrator benchmarks                               *
+ *                                                     *
+ * Times the integrators' particle steps, and their    *
+ * stability and accuracy on a stiff cloth.            *
+ *******************************************************/
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "../src/sim.h"
+#include "../src/integrators.h"
+
+using namespace Sim;
+
+namespace {
+
+//------------------------------------------------------------------------------
+
+/** Largest particle speed, infinite once anything has blown up */
+unit speed(Simulation &sim)
+{
+	const ParticleSystem &s = Bench::Probe(sim).particles();
+	unit top = 0.0;
+	for (size_t i = 0; i < s.size; ++i)
+	{
+		unit v = s.v[i].length();
+		top = v > top || v != v ? v : top;
+	}
+	return top == top ? top : 1.0 / 0.0;
+}
+
+} /* namespace */
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(integrators)
+{
+	const int n = 20000;
+	Simulation sim("bench");
+	for (int i = 0; i < n; ++i)
+		sim.addParticle(Vec(i * 1e-4, 0.5), Vec(0.0, 0.1), Vec(0.0, -1.0), 1.0);
+	Bench::Probe probe(sim);
+	
+	Euler euler(sim);
+	Verlet verlet(sim);
+	MidPoint<Verlet> midpoint(sim);
+	RungeKutta4<Verlet> runge(sim);
+	Bench::report("Euler::integrate", Bench::measure([&]() { euler.integrate(1e-6); }));
+	Bench::report("Verlet::integrate", Bench::measure([&]() { verlet.integrate(1e-6); }));
+	Bench::report("saveState + restoreState", Bench::measure([&]()
+		{ probe.save(); probe.restore(); }));
+	Bench::report("MidPoint<Verlet>::integrate", Bench::measure([&]()
+		{ midpoint.integrate(1e-6); }));
+	Bench::report("RungeKutta4<Verlet>::integrate", Bench::measure([&]()
+		{ runge.integrate(1e-6); }));
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(stiff_cloth)
+{
+	const int n = 10;
+	const unit seconds = 1.0;
+	printf("  %dx%d cloth, ks -1000, kd -100, %.0f simulated second\n", n, n, seconds);
+	double t = 0.0;
+	auto run = [&](bool implicitly, unit h)
+	{
+		Simulation sim("bench");
+		Bench::cloth(sim, n, -1000.0, -100.0);
+		Verlet verlet(sim);
+		ImplicitEuler implicit(sim);
+		const int steps = (int) (seconds / h + 0.5);
+		int iterations = 0;
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		for (int k = 0; k < steps; ++k)
+		{
+			if (implicitly)
+				sim.act(implicit, h);
+			else
+				sim.act(verlet, h);
+			iterations += implicit.stats.iterations;
+		}
+		double time = std::chrono::duration<double>(clock::now() - start).count();
+		
+		char what[96];
+		if (implicitly)
+			snprintf(what, sizeof(what), "ImplicitEuler, h %g (speed %.1e, %.1f it)", h,
+				speed(sim), (double) iterations / steps);
+		else
+			snprintf(what, sizeof(what), "Verlet, h %g (speed %.1e)", h, speed(sim));
+		if (t > 0.0)
+			Bench::report(what, time, t);
+		else
+			Bench::report(what, t = time);
+	};
+	run(false, 0.001);
+	run(false, 0.002);
+	run(false, 0.005); // Unstable
+	run(true, 0.001);
+	run(true, 0.01);
+	run(true, 0.03);
+	run(true, 0.1);
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(adaptive_steps)
+{
+	const int n = 10;
+	const unit seconds = 4.0;
+	printf("  %dx%d cloth settling, %.0f simulated seconds\n", n, n, seconds);
+	double t = 0.0;
+	for (unit tolerance : {0.0, 1e-4, 1e-3})
+	{
+		Simulation sim("bench");
+		Bench::cloth(sim, n, -1000.0, -100.0);
+		Verlet verlet(sim);
+		Adaptive<Verlet> adaptive(sim, tolerance);
+		int frames = 0;
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		for (unit time = 0.0; time < seconds; ++frames)
+		{
+			// The caller lets the controller pick the frame's step
+			unit h = tolerance > 0.0 ? adaptive.step : 0.001;
+			sim.act(tolerance > 0.0 ? (Integrator &) adaptive : verlet, h);
+			time += h;
+		}
+		double time = std::chrono::duration<double>(clock::now() - start).count();
+		
+		char what[96];
+		if (tolerance > 0.0)
+			snprintf(what, sizeof(what), "Adaptive<Verlet>, tol %g (%d frames, %d/%d steps)",
+				tolerance, frames, (int) adaptive.accepted, (int) adaptive.rejected);
+		else
+			snprintf(what, sizeof(what), "Verlet, h 0.001 (%d frames)", frames);
+		if (t > 0.0)
+			Bench::report(what, time, t);
+		else
+			Bench::report(what, t = time);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(xpbd_cloth)
+{
+	const unit seconds = 1.0;
+	for (int n : {10, 20, 40})
+	{
+		printf("  %dx%d cloth, %.0f simulated second\n", n, n, seconds);
+		double t = 0.0;
+		Vec reference;
+		auto run = [&](bool projected, unit h)
+		{
+			Simulation sim("bench");
+			Bench::cloth(sim, n, -1000.0, -100.0);
+			Verlet verlet(sim);
+			PositionBased xpbd(sim);
+			typedef std::chrono::steady_clock clock;
+			clock::time_point start = clock::now();
+			for (int k = (int) (seconds / h + 0.5); k > 0; --k)
+				sim.act(projected ? (Integrator &) xpbd : verlet, h);
+			double time = std::chrono::duration<double>(clock::now() - start).count();
+			
+			// The middle of the cloth's free edge, against Verlet's
+			Vec x = Bench::Probe(sim).particles().x[n / 2 * n];
+			char what[96];
+			if (projected)
+				snprintf(what, sizeof(what), "PositionBased, h %.3f (%d x %d, off by %.1e)",
+					h, xpbd.substeps, xpbd.iterations, (x - reference).length());
+			else
+				snprintf(what, sizeof(what), "Verlet, h %.3f", h);
+			if (t > 0.0)
+				Bench::report(what, time, t);
+			else
+			{
+				Bench::report(what, t = time);
+				reference = x;
+			}
+		};
+		run(false, 0.001);
+		run(true, 1.0 / 60.0);
+		run(true, 1.0 / 30.0);
+	}
+}
+
+//..............................................................................
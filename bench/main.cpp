@@ -0,0 +1,97 @@
+/*******************************************************
+ * Benchmarks -- See header file for more information. *
+ *******************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+namespace Bench {
+
+//------------------------------------------------------------------------------
+
+std::vector<Case *> &cases()
+{
+	static std::vector<Case *> list;
+	return list;
+}
+
+Case::Case(const char *n, Function f) : name(n), func(f)
+{
+	cases().push_back(this);
+}
+
+//------------------------------------------------------------------------------
+
+void report(const char *what, double seconds)
+{
+	printf("  %-40s %12.3f us\n", what, seconds * 1e6);
+}
+
+void report(const char *what, double seconds, double baseline)
+{
+	printf("  %-40s %12.3f us  (x%.2f)\n", what, seconds * 1e6,
+		baseline / seconds);
+}
+
+//------------------------------------------------------------------------------
+
+Sim::SpringNetwork *cloth(Sim::Simulation &sim, int n, Base::unit ks, Base::unit kd,
+	bool network, bool hung)
+{
+	using namespace Sim;
+	const unit d = 0.5 / n;
+	std::vector<ParticleBase *> grid;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+			grid.push_back(sim.addParticle(Vec(0.25 + i * d, 0.25 + j * d)));
+	
+	SpringNetwork *springs = network ? sim.create<SpringNetwork>(&sim) : NULL;
+	auto link = [&](ParticleBase *p1, ParticleBase *p2)
+	{
+		if (springs)
+			springs->add(p1, p2, d, ks, kd);
+		else
+			sim.create<Spring>(p1, p2, d, ks, kd);
+	};
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+		{
+			if (i + 1 < n) link(grid[i * n + j], grid[(i + 1) * n + j]);
+			if (j + 1 < n) link(grid[i * n + j], grid[i * n + j + 1]);
+		}
+	if (hung)
+	{
+		sim.create<Glue>(grid[n - 1], *grid[n - 1]->x);
+		sim.create<Glue>(grid[n * n - 1], *grid[n * n - 1]->x);
+		sim.create<Gravity>(&sim, Vec(0.0, -10.0));
+	}
+	return springs;
+}
+
+//------------------------------------------------------------------------------
+
+} /* namespace Bench */
+
+// Usage: Bench [name...]
+// Runs all registered benchmarks, or only those whose name contains one of
+// the given arguments. No window is opened, so this runs on headless nodes.
+
+int main(int argc, char *argv[])
+{
+	for (Bench::Case *c : Bench::cases())
+	{
+		bool run = argc < 2;
+		for (int i = 1; i < argc && !run; ++i)
+			run = strstr(c->name, argv[i]) != NULL;
+		if (!run)
+			continue;
+		printf("[%s]\n", c->name);
+		c->func();
+	}
+	return (EXIT_SUCCESS);
+}
+
+//..............................................................................
@@ -0,0 +1,53 @@
+/*******************************************************
+ * Spring benchmarks                                   *
+ *                                                     *
+ * Force pass of a cloth built from individual Spring  *
+ * entities versus the same cloth in a SpringNetwork.  *
+ *******************************************************/
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "../src/threads.h"
+
+using namespace Sim;
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(springs)
+{
+	const int n = 150;
+	double t;
+	{
+		Simulation sim("bench");
+		Bench::cloth(sim, n, -1000.0, -100.0, false, false);
+		Bench::Probe probe(sim);
+		t = Bench::measure([&]() { probe.forces(); });
+		Bench::report("calcForces (Spring entities)", t);
+	}
+	{
+		Simulation sim("bench");
+		Bench::cloth(sim, n, -1000.0, -100.0, true, false);
+		Bench::Probe probe(sim);
+		Bench::report("calcForces (SpringNetwork)",
+			Bench::measure([&]() { probe.forces(); }), t);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(springs_parallel)
+{
+	const int n = 150;
+	Simulation sim("bench");
+	SpringNetwork *springs = Bench::cloth(sim, n, -1000.0, -100.0, true, false);
+	printf("  %u threads\n", Threads::pool().size());
+	springs->parallel = false;
+	double t = Bench::measure([&]() { springs->apply(); });
+	Bench::report("SpringNetwork::apply (serial)", t);
+	springs->parallel = true;
+	Bench::report("SpringNetwork::apply (parallel)",
+		Bench::measure([&]() { springs->apply(); }), t);
+}
+
+//..............................................................................
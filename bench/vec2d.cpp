@@ -0,0 +1,160 @@
+/*******************************************************
+ * Vector layout benchmarks                            *
+ *                                                     *
+ * Compares the packed Vec2d against the former layout *
+ * (two reference members into the data array) on the  *
+ * hot loops of the simulation.                        *
+ *******************************************************/
+
+#include <math.h>
+
+#include "bench.h"
+#include "../src/sim.h"
+#include "../src/forces.h"
+#include "../src/integrators.h"
+
+using namespace Sim;
+
+namespace {
+
+//------------------------------------------------------------------------------
+// Former Vec2d layout, reduced to the operators used below
+
+struct RefVec2d : public Vector<2>
+{
+	unit &x, &y;
+	
+	RefVec2d(unit _x = 0, unit _y = 0) : x(data[0]), y(data[1])
+		{ x = _x; y = _y; }
+	RefVec2d(const RefVec2d &v) : x(data[0]), y(data[1])
+		{ x = v.x; y = v.y; }
+	RefVec2d &operator =(const RefVec2d &v)
+		{ x = v.x; y = v.y; return *this; }
+	
+	RefVec2d operator +(const RefVec2d &v) const
+		{ return RefVec2d(x + v.x, y + v.y); }
+	RefVec2d operator -(const RefVec2d &v) const
+		{ return RefVec2d(x - v.x, y - v.y); }
+	RefVec2d operator *(unit s) const
+		{ return RefVec2d(x * s, y * s); }
+	RefVec2d operator /(unit s) const
+		{ return RefVec2d(x / s, y / s); }
+	RefVec2d &operator +=(const RefVec2d &v)
+		{ x += v.x; y += v.y; return *this; }
+	RefVec2d &operator -=(const RefVec2d &v)
+		{ x -= v.x; y -= v.y; return *this; }
+	unit operator *(const RefVec2d &v) const
+		{ return x * v.x + y * v.y; }
+	unit length() const
+		{ return sqrt(x * x + y * y); }
+	bool operator !() const
+		{ return x == 0.0 && y == 0.0; }
+};
+
+static inline RefVec2d operator *(unit s, const RefVec2d &v)
+	{ return RefVec2d(s * v.x, s * v.y); }
+
+//------------------------------------------------------------------------------
+// The same kernels, instantiated for either layout
+
+template <class V>
+void euler(std::vector<V> &x, std::vector<V> &v, const std::vector<V> &f,
+	const units &m, unit h)
+{
+	for (size_t i = 0; i < x.size(); ++i)
+	{
+		v[i] += h * f[i] / m[i];
+		x[i] += h * v[i];
+	}
+}
+
+template <class V>
+void springs(const std::vector<V> &x, const std::vector<V> &v, std::vector<V> &f,
+	const std::vector<std::pair<int,int> > &pairs, unit rest, unit ks, unit kd)
+{
+	for (auto &s : pairs)
+	{
+		V dx = x[s.first] - x[s.second],
+			dv = v[s.first] - v[s.second];
+		if (!dx)
+			continue;
+		unit l = dx.length();
+		V F = ((ks * (l - rest)) + (kd * (dv * dx) / l)) * (dx / l);
+		f[s.first] += F;
+		f[s.second] -= F;
+	}
+}
+
+template <class V>
+void run(const char *label, int n, double *times)
+{
+	std::vector<V> x, v, f;
+	units m(n * n, 1.0);
+	std::vector<std::pair<int,int> > pairs;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+		{
+			x.push_back(V(i * 0.01, j * 0.01));
+			v.push_back(V(0.001 * j, 0.0));
+			f.push_back(V(0.0, -1.0));
+			if (i + 1 < n) pairs.push_back(std::make_pair(i * n + j, (i + 1) * n + j));
+			if (j + 1 < n) pairs.push_back(std::make_pair(i * n + j, i * n + j + 1));
+		}
+	std::vector<V> cache;
+	
+	times[0] = Bench::measure([&]() { euler(x, v, f, m, 1e-6); });
+	times[1] = Bench::measure([&]() { cache = x; cache = v; Bench::keep(cache); });
+	times[2] = Bench::measure([&]() { springs(x, v, f, pairs, 0.01, -1000.0, -100.0); });
+	
+	printf("  %s: %d bytes per vector\n", label, (int) sizeof(V));
+}
+
+} /* namespace */
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(vec2d_layout)
+{
+	const int n = 200; // 40k particles, ~80k springs
+	double ref[3], packed[3];
+	run<RefVec2d>("reference members", n, ref);
+	run<Vec2d>("packed", n, packed);
+	Bench::report("euler (reference members)", ref[0]);
+	Bench::report("euler (packed)", packed[0], ref[0]);
+	Bench::report("state copy (reference members)", ref[1]);
+	Bench::report("state copy (packed)", packed[1], ref[1]);
+	Bench::report("springs (reference members)", ref[2]);
+	Bench::report("springs (packed)", packed[2], ref[2]);
+}
+
+//------------------------------------------------------------------------------
+
+BENCHMARK(vec2d_simulation)
+{
+	const int n = 100;
+	Simulation sim("bench");
+	std::vector<ParticleBase *> grid;
+	std::vector<Spring *> springs;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+			grid.push_back(sim.addParticle(Vec(i * 0.01, j * 0.01)));
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+		{
+			if (i + 1 < n)
+				springs.push_back(sim.create<Spring>(grid[i * n + j],
+					grid[(i + 1) * n + j], 0.01, -1000.0, -100.0));
+			if (j + 1 < n)
+				springs.push_back(sim.create<Spring>(grid[i * n + j],
+					grid[i * n + j + 1], 0.01, -1000.0, -100.0));
+		}
+	
+	Euler euler(sim);
+	Bench::Probe probe(sim);
+	Bench::report("Euler::integrate", Bench::measure([&]() { euler.integrate(1e-6); }));
+	Bench::report("Simulation::saveState", Bench::measure([&]() { probe.save(); }));
+	Bench::report("Spring::apply (all)", Bench::measure([&]()
+		{ for (Spring *s : springs) s->apply(); }));
+}
+
+//..............................................................................
@@ -10,13 +10,6 @@ namespace Base {
 
 //------------------------------------------------------------------------------
 
-unit Vec2d::length() const
-{
-	return sqrt(x * x + y * y);
-}
-
-//------------------------------------------------------------------------------
-
 unit Vec2d::lengthM() const
 {
 	return abs(x + y);
@@ -12,7 +12,9 @@
 #ifndef _BASE_H
 #define _BASE_H
 
+#include <math.h>
 #include <ostream>
+#include <type_traits>
 
 namespace Base {
 
@@ -37,14 +39,24 @@ struct Vector
 
 //------------------------------------------------------------------------------
 
-struct Vec2d : public Vector<2>
+// Plain value type: two units, no indirection, so arrays of vectors are
+// densely packed and can be copied with memcpy.
+
+struct alignas(2 * sizeof(unit)) Vec2d
 {
-	unit &x, &y;
+	unit x, y;
+	static const int dim = 2;
+	
+	Vec2d(unit _x = 0, unit _y = 0) : x(_x), y(_y) {}
 	
-	Vec2d(unit _x = 0, unit _y = 0) : x(data[0]), y(data[1])
-		{ x = _x; y = _y; }
-	Vec2d(const Vec2d &v) : x(data[0]), y(data[1]) // Copy constructor
-		{ x = v.x; y = v.y; }
+	unit *data() // Contiguous (x, y), e.g. for glVertex2dv
+		{ return &x; }
+	const unit *data() const
+		{ return &x; }
+	unit &operator[] (int i)
+		{ return data()[i]; }
+	unit operator[] (int i) const
+		{ return data()[i]; }
 	
 	Vec2d operator -() const
 		{ return Vec2d(-x, -y); }
@@ -61,8 +73,6 @@ struct Vec2d : public Vector<2>
 	Vec2d operator /(unit s) const
 		{ return Vec2d(x / s, y / s); }
 	
-	Vec2d &operator =(const Vec2d &v)
-		{ x = v.x; y = v.y; return *this; }
 	Vec2d &operator +=(unit s)
 		{ x += s; y += s; return *this; }
 	Vec2d &operator +=(const Vec2d &v)
@@ -76,7 +86,8 @@ struct Vec2d : public Vector<2>
 	Vec2d &operator /= (unit s)
 		{ x /= s; y /= s; return *this; }
 	
-	unit length() const;
+	unit length() const
+		{ return sqrt(x * x + y * y); }
 	unit lengthM() const;
 	unit length2() const
 		{ return x * x + y * y; }
@@ -113,6 +124,10 @@ static inline Vec2d operator *(unit s, const Vec2d &v)
 static inline Vec2d operator /(unit s, const Vec2d &v)
 	{ return Vec2d(s / v.x, s / v.y); }
 
+static_assert(sizeof(Vec2d) == 2 * sizeof(unit), "Vec2d must be packed");
+static_assert(std::is_trivially_copyable<Vec2d>::value,
+	"Vec2d must be trivially copyable");
+
 //------------------------------------------------------------------------------
 // Useful for debugging:
 
@@ -125,6 +140,11 @@ std::ostream &operator <<(std::ostream &out, const Vector<R> &v)
 	return out << ')';
 }
 
+static inline std::ostream &operator <<(std::ostream &out, const Vec2d &v)
+{
+	return out << '(' << v.x << ", " << v.y << ')';
+}
+
 //------------------------------------------------------------------------------
 
 } /* namespace Base */
@@ -0,0 +1,113 @@
+/********************************************************
+ * Broad phase -- See header file for more information. *
+ ********************************************************/
+
+#include <algorithm>
+
+#include "broadphase.h"
+
+namespace Sim {
+
+//------------------------------------------------------------------------------
+
+// Min endpoints go before max endpoints of equal value, so touching boxes
+// count as overlapping, just like Bounds::overlaps
+#define BEFORE(a, b) ((a).value < (b).value \
+	|| ((a).value == (b).value && !(a).max && (b).max))
+
+static inline unit coordinate(const Bounds &b, int dim, bool max)
+{
+	const Vec &v = max ? b.max : b.min;
+	return dim ? v.y : v.x;
+}
+
+//------------------------------------------------------------------------------
+
+void SweepAndPrune::update(const std::vector<Bounds> &b)
+{
+	if (b.size() != bounds.size())
+	{
+		bounds = b;
+		rebuild();
+		return;
+	}
+	bounds = b;
+	repair(0);
+	repair(1);
+}
+
+void SweepAndPrune::clear()
+{
+	bounds.clear();
+	axis[0].clear();
+	axis[1].clear();
+}
+
+//------------------------------------------------------------------------------
+
+void SweepAndPrune::rebuild()
+{
+	for (int dim = 0; dim < 2; ++dim)
+	{
+		std::vector<Endpoint> &list = axis[dim];
+		list.resize(2 * bounds.size());
+		for (size_t i = 0; i < bounds.size(); ++i)
+		{
+			list[2 * i] = {coordinate(bounds[i], dim, false), (unsigned) i, 0};
+			list[2 * i + 1] = {coordinate(bounds[i], dim, true), (unsigned) i, 1};
+		}
+		std::sort(list.begin(), list.end(), [](const Endpoint &a, const Endpoint &b)
+			{ return BEFORE(a, b); });
+	}
+	
+	listener->cleared();
+	const std::vector<Endpoint> &list = axis[0];
+	for (size_t i = 0; i < list.size(); ++i)
+	{
+		if (list[i].max)
+			continue;
+		const size_t a = list[i].body;
+		for (size_t k = i + 1; list[k].body != a; ++k)
+		{
+			const size_t b = list[k].body;
+			if (!list[k].max && bounds[a].overlaps(bounds[b]))
+				listener->added(std::min(a, b), std::max(a, b));
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
+void SweepAndPrune::repair(int dim)
+{
+	std::vector<Endpoint> &list = axis[dim];
+	for (Endpoint &e : list)
+		e.value = coordinate(bounds[e.body], dim, e.max);
+	
+	for (size_t i = 1; i < list.size(); ++i)
+	{
+		const Endpoint e = list[i];
+		size_t j = i;
+		for (; j > 0 && BEFORE(e, list[j - 1]); --j)
+		{
+			const Endpoint &o = list[j - 1];
+			const size_t a = std::min<size_t>(e.body, o.body);
+			const size_t b = std::max<size_t>(e.body, o.body);
+			if (!e.max && o.max) // Starts overlapping along this axis
+			{
+				if (bounds[a].overlaps(bounds[b]))
+					listener->added(a, b);
+			}
+			else if (e.max && !o.max) // Stops overlapping along this axis
+				listener->removed(a, b);
+			list[j] = o;
+		}
+		list[j] = e;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+} /* namespace Sim */
+
+//..............................................................................
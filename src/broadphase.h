@@ -0,0 +1,79 @@
+/*******************************************************
+ * Broad phase -- header file                          *
+ *                                                     *
+ * Authors: Ferry Timmers                              *
+ *                                                     *
+ * Date: 17:20 17-10-2026                              *
+ *                                                     *
+ * Description: Incremental sweep and prune over axis  *
+ *              aligned bounding boxes.                *
+ *******************************************************/
+
+#ifndef _BROADPHASE_H
+#define _BROADPHASE_H
+
+#include <vector>
+
+#include "base.h"
+
+namespace Sim {
+
+using namespace Base;
+
+//------------------------------------------------------------------------------
+
+struct Bounds
+{
+	Vec min, max;
+	
+	bool overlaps(const Bounds &b) const
+		{ return min.x <= b.max.x && b.min.x <= max.x
+			&& min.y <= b.max.y && b.min.y <= max.y; }
+};
+
+//------------------------------------------------------------------------------
+
+/** Keeps the box endpoints sorted along both axes between updates. Since
+    bodies move little per step, the lists are repaired with an insertion sort
+    and every swap of a min and a max endpoint reports a change in overlap. */
+class SweepAndPrune
+{
+public:
+	/** Receives overlap changes; pairs are reported as (a, b) with a < b */
+	class Listener
+	{
+	public:
+		virtual void added(size_t a, size_t b) = 0;
+		virtual void removed(size_t a, size_t b) = 0;
+		virtual void cleared() {} // All pairs are reported again
+		virtual ~Listener() {}
+	};
+	
+	SweepAndPrune(Listener *_listener) : listener(_listener) {}
+	
+	/** Moves the boxes to their new bounds, a different count rebuilds */
+	void update(const std::vector<Bounds> &);
+	void clear();
+
+private:
+	struct Endpoint
+	{
+		unit value;
+		unsigned body : 31;
+		unsigned max : 1;
+	};
+	Listener *listener;
+	std::vector<Bounds> bounds;
+	std::vector<Endpoint> axis[2];
+	
+	void rebuild();
+	void repair(int dim);
+};
+
+//------------------------------------------------------------------------------
+
+} /* namespace Sim */
+
+#endif /* _BROADPHASE_H */
+
+//..............................................................................
@@ -31,8 +31,8 @@ void ParticleBase::draw()
 		glColor3dv(cyan);
 		
 		glBegin(GL_LINES);
-		glVertex2dv(x->data);
-		glVertex2dv((*x + *v).data);
+		glVertex2dv(x->data());
+		glVertex2dv((*x + *v).data());
 		glEnd();
 	}
 }
@@ -103,6 +103,55 @@ struct ParticleSystem
 
 //------------------------------------------------------------------------------
 
+/** Forces that can give their derivatives, for implicit integration */
+class Differentiable
+{
+public:
+	/** Adds (cx df/dx + cv df/dv) y to out; y and out are indexed like s */
+	virtual void differentiate(const ParticleSystem &s, unit cx, unit cv,
+		const Vec *y, Vec *out) = 0;
+	virtual ~Differentiable() {}
+};
+
+//------------------------------------------------------------------------------
+
+/** Forces that hold particles in place; implicit integrators leave those
+    particles out of their solve */
+class Constraint
+{
+public:
+	/** Clears the entries of y for the held particles */
+	virtual void constrain(const ParticleSystem &s, Vec *y) = 0;
+	virtual ~Constraint() {}
+};
+
+//------------------------------------------------------------------------------
+
+/** State of one substep of position based dynamics */
+struct Projection
+{
+	ParticleSystem &s; // Positions are the predicted ones
+	const Vec *x0; // Positions at the start of the substep
+	const unit *w; // Inverse masses, 0 for held particles
+	unit h; // Substep size
+	bool first; // First iteration of the substep; multipliers start at 0
+};
+
+/** Forces that can instead be solved as constraints on the positions, by
+    extended position based dynamics (XPBD). Their compliance follows from
+    their stiffness, so scenes build them the same way either way. */
+class Projectable
+{
+public:
+	/** One Gauss-Seidel pass over the constraint(s) */
+	virtual void project(const Projection &) = 0;
+	/** Whether to solve it as a constraint now; if not it stays a force */
+	virtual bool projected() const { return true; }
+	virtual ~Projectable() {}
+};
+
+//------------------------------------------------------------------------------
+
 class Quad : public Entity
 {
 public:
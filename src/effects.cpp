@@ -48,14 +48,14 @@ void Sheet::draw()
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
 	glBindTexture(GL_TEXTURE_2D, (GLuint) tex->index);
 	glBegin(GL_QUADS);
-	glTexCoord2dv(c1.data);
-	glVertex2dv(p1->x->data);
-	glTexCoord2dv(c2.data);
-	glVertex2dv(p2->x->data);
-	glTexCoord2dv(c3.data);
-	glVertex2dv(p3->x->data);
-	glTexCoord2dv(c4.data);
-	glVertex2dv(p4->x->data);
+	glTexCoord2dv(c1.data());
+	glVertex2dv(p1->x->data());
+	glTexCoord2dv(c2.data());
+	glVertex2dv(p2->x->data());
+	glTexCoord2dv(c3.data());
+	glVertex2dv(p3->x->data());
+	glTexCoord2dv(c4.data());
+	glVertex2dv(p4->x->data());
 	glEnd();
 	glFlush();
 	glDisable(GL_TEXTURE_2D);
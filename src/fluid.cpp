@@ -3,39 +3,53 @@
  *************************************************************/
 
 #include "math.h"
-#include <queue>
 #include <algorithm>
 
 #include "GL/freeglut.h"
 
 #include "fluid.h"
+#include "simd.h"
+#include "threads.h"
 
 namespace Sim {
 
 #define IX(i,j) ((i)+(width+2)*(j))
 #define CLAMPX(i) ((i) < 0 ? 0 : (i) > (width+1) ? (width+1) : (i))
 #define CLAMPY(j) ((j) < 0 ? 0 : (j) > (height+1) ? (height+1) : (j))
-#define SWAP(x0,x) {unit *tmp=x0;x0=x;x=tmp;}
+#define SWAP(x0,x) {real *tmp=x0;x0=x;x=tmp;}
 #define FOR_EACH_CELL(i,j) \
-	for (int i = 1; i <= width; ++i) { \
-	for (int j = 1; j <= height; ++j) {
+	for (int j = 1; j <= height; ++j) { \
+	for (int i = 1; i <= width; ++i) {
+#define FOR_EACH_ACTIVE(i,j) \
+	for (const Span &span : active) { const int j = span.j; \
+	for (int i = span.begin; i < span.end; ++i) {
 #define END_FOR }}
 
 bool Fluid::VelocityMode = false;
+bool Fluid::Vectorised = true;
+
+const int Tile = 16; // Cells per side of a sparse tile
+const unit Negligible = 1e-4; // Largest density or source on an empty tile
+const int Margin = 2; // Cells refined around the ones that need it
+const int Slack = 1; // More cells refined, so that the patches need not move often
+const int Block = 4; // Cells per side of the blocks patches are made of
+const unit Fill = 0.7; // Of the blocks of a patch, at least, that need refining
+const int Band = 4; // Rows of cells coupled by one thread at a time
 
 //------------------------------------------------------------------------------
 
 Fluid::Fluid(Simulation *s, int w, int h, unit V, unit D, Vec G, unit S)
-	: sim(s), width(w), height(h), visc(V), diff(D), g(G), speed(S)
+	: sim(s), width(w), height(h), visc(V), diff(D), g(G), speed(S),
+	solver(new GaussSeidelSolver(w, h))
 {
 	const size_t size = (w + 2)*(h + 2);
-	u     = new unit[size];
-	u_old = new unit[size];
-	v     = new unit[size];
-	v_old = new unit[size];
-	d     = new unit[size];
-	d_old = new unit[size];
-	p = new Entity *[size];
+	u     = new real[size];
+	u_old = new real[size];
+	v     = new real[size];
+	v_old = new real[size];
+	d     = new real[size];
+	d_old = new real[size];
+	p = new int[size];
 
 	std::fill(u, u + size, 0.0);
 	std::fill(u_old, u_old + size, 0.0);
@@ -43,7 +57,26 @@ Fluid::Fluid(Simulation *s, int w, int h, unit V, unit D, Vec G, unit S)
 	std::fill(v_old, v_old + size, 0.0);
 	std::fill(d, d + size, 0.0);
 	std::fill(d_old, d_old + size, 0.0);
-	std::fill(p, p + size, nullptr);
+	std::fill(p, p + size, 0);
+	covers.assign(size, -1);
+	spare = -1;
+	uf = vf = uf0 = vf0 = NULL;
+	warm = true;
+	sparse = false;
+	still = 1e-3;
+	refine = 0;
+	curl = 40.0;
+	parent = NULL;
+	offset_i = offset_j = 0;
+	share = 1.0;
+	sx = w;
+	sy = h;
+	projections = 0;
+	traffic = 0;
+	source.cell = IX(1, 1);
+	source.v = Vec();
+	source.d = 0.0;
+	mark();
 }
 
 Fluid::~Fluid()
@@ -55,6 +88,75 @@ Fluid::~Fluid()
 	delete[] d;
 	delete[] d_old;
 	delete[] p;
+	delete solver;
+	for (Fluid *patch : patches)
+		delete patch;
+	setStaggered(false);
+}
+
+void Fluid::setSolver(LinearSolver *s)
+{
+	delete solver;
+	solver = s;
+	for (Fluid *patch : patches)
+		patch->setSolver(s->resized(patch->width, patch->height));
+}
+
+void Fluid::setStaggered(bool on)
+{
+	if (on == staggered())
+		return;
+	if (!on)
+	{
+		delete[] uf;
+		delete[] vf;
+		delete[] uf0;
+		delete[] vf0;
+		uf = vf = uf0 = vf0 = NULL;
+		return;
+	}
+	
+	// Faces start as the average of the cells on either side, walls closed
+	const size_t size = (width + 2)*(height + 2);
+	uf  = new real[size];
+	vf  = new real[size];
+	uf0 = new real[size];
+	vf0 = new real[size];
+	std::fill(uf, uf + size, 0.0);
+	std::fill(vf, vf + size, 0.0);
+	std::fill(uf0, uf0 + size, 0.0);
+	std::fill(vf0, vf0 + size, 0.0);
+	FOR_EACH_CELL(i, j)
+		if (i < width) uf[IX(i, j)] = 0.5 * (u[IX(i, j)] + u[IX(i + 1, j)]);
+		if (j < height) vf[IX(i, j)] = 0.5 * (v[IX(i, j)] + v[IX(i, j + 1)]);
+	END_FOR
+}
+
+GUI::Rect Fluid::area() const
+{
+	if (!parent)
+		return sim->bounds;
+	
+	// Cell i of a patch lies (i - 1/2) / ratio cells right of the left side of
+	// the parent cell offset_i + 1, in the same way for j
+	const GUI::Rect b = parent->area();
+	const unit r = sx / parent->sx,
+		dx = (b.right - b.left) / parent->width,
+		dy = (b.bottom - b.top) / parent->height,
+		left = b.left + (offset_i + 0.5 - 0.5 / r) * dx,
+		top = b.top + (offset_j + 0.5 - 0.5 / r) * dy;
+	return {(float) left, (float) (left + width / r * dx),
+		(float) top, (float) (top + height / r * dy)};
+}
+
+bool Fluid::refined(int i, int j) const
+{
+	for (const Fluid *patch : patches)
+		if (i > patch->offset_i && j > patch->offset_j
+			&& i <= patch->offset_i + patch->width / refine
+			&& j <= patch->offset_j + patch->height / refine)
+			return true;
+	return false;
 }
 
 //------------------------------------------------------------------------------
@@ -62,19 +164,20 @@ Fluid::~Fluid()
 void Fluid::draw()
 {
 	unit x, y, d00, d01, d10, d11;
+	const GUI::Rect bounds = area();
 	unit r = (unit) width / (unit) height,
-		dx = (sim->bounds.right - sim->bounds.left) / (unit) width,
-		dy = (sim->bounds.bottom - sim->bounds.top) / (unit) height;
+		dx = (bounds.right - bounds.left) / (unit) width,
+		dy = (bounds.bottom - bounds.top) / (unit) height;
 	
 	if (Fluid::VelocityMode)
 	{
 		glBegin(GL_LINES);
 		for (int i = 0; i <= width; ++i)
 		{
-			x = (i - 0.5) * dx + sim->bounds.left;
+			x = (i - 0.5) * dx + bounds.left;
 			for (int j = 0; j <= height; ++j)
 			{
-				y = (j - 0.5) * dy + sim->bounds.top;
+				y = (j - 0.5) * dy + bounds.top;
 				Vec vel(u[IX(i, j)], v[IX(i, j)]);
 				unit norm = vel.length();
 				vel /= norm;
@@ -86,16 +189,18 @@ void Fluid::draw()
 			}
 		}
 		glEnd();
+		for (Fluid *patch : patches)
+			patch->draw();
 		return;
 	}
 	
 	glBegin(GL_QUADS);
 	for (int i = 0; i <= width; ++i)
 	{
-		x = (i - 0.5) * dx + sim->bounds.left;
+		x = (i - 0.5) * dx + bounds.left;
 		for (int j = 0; j <= height; ++j)
 		{
-			y = (j - 0.5) * dy + sim->bounds.top;
+			y = (j - 0.5) * dy + bounds.top;
 			d00 = d[IX(i, j)];
 			d01 = d[IX(i, j + 1)];
 			d10 = d[IX(i + 1, j)];
@@ -113,30 +218,35 @@ void Fluid::draw()
 		}
 	}
 	glEnd();
+	for (Fluid *patch : patches)
+		patch->draw();
 }
 
+/** Rows of cells covered by a polygon, by sweeping its edges down the grid */
 template <int N>
-void actPolygon(Fluid &fluid, Vec verts[N], Entity *ent)
+static void rasterize(const Fluid &fluid, const Vec *verts, Spans &out)
 {
 	const int &width = fluid.width;
 	const int &height = fluid.height;
-	unit fx = (unit) width / (fluid.sim->bounds.right - fluid.sim->bounds.left);
-	unit fy = (unit) height / (fluid.sim->bounds.bottom - fluid.sim->bounds.top);
+	const GUI::Rect bounds = fluid.area();
+	unit fx = (unit) width / (bounds.right - bounds.left);
+	unit fy = (unit) height / (bounds.bottom - bounds.top);
 	
-	// Sweep algorithm
+	// Sweep algorithm, with the structures on the stack since N is small
 	
 	// Generate edges
 	struct edge
 	{
 		unit ymin, ymax, x, s;
 	};
-	std::vector<edge> edges;
+	edge edges[N];
+	int n = 0;
 	for (int i = 0; i < N; ++i)
 	{
 		Vec u = verts[i];
 		Vec v = verts[(i + 1) % N];
-		u.x -= fluid.sim->bounds.left;
-		v.x -= fluid.sim->bounds.left;
+		u -= Vec(bounds.left, bounds.top);
+		v -= Vec(bounds.left, bounds.top);
 		u.x *= fx;	u.y *= fy;
 		v.x *= fx;	v.y *= fy;
 		
@@ -144,51 +254,47 @@ void actPolygon(Fluid &fluid, Vec verts[N], Entity *ent)
 		if ((1.0 / s) == 0.0) // Skip horizontal edges
 			continue;
 		if (u.y < v.y)
-			edges.push_back({u.y, v.y, u.x, s});
+			edges[n++] = {u.y, v.y, u.x, s};
 		else
-			edges.push_back({v.y, u.y, v.x, s});
+			edges[n++] = {v.y, u.y, v.x, s};
 	}
 	
-	// Generate event structure
-	auto order = [](edge *u, edge *v) -> bool
-	{
-		if (u->ymin == v->ymin)
-			return v->x < u->x;
-		return v->ymin < u->ymin;
-	};
-	std::priority_queue<edge *, std::vector<edge *>, decltype(order)> events(order);
+	// Generate event structure: edges by the row they start on
+	edge *events[N];
 	unit ymin = height;
 	unit ymax = 1.0;
-	for (auto &e : edges)
+	for (int i = 0; i < n; ++i)
 	{
+		edge &e = edges[i];
 		if (e.ymin < ymin)
 			ymin = e.ymin >= 0.0 ? e.ymin : 0.0;
 		if (e.ymax > ymax)
 			ymax = e.ymax <= (unit) height + 1.0 ? e.ymax : height + 1.0;
-		events.push(&e);
+		int k = i;
+		for (; k > 0 && events[k - 1]->ymin > e.ymin; --k)
+			events[k] = events[k - 1];
+		events[k] = &e;
 	}
 	
 	// Generate status structure
-	std::vector<edge *> status;
+	edge *status[N];
+	int M = 0, next = 0;
 	
 	// Sweep
+	out.clear();
 	for (int y = round(ymin); y <= round(ymax); ++y)
 	{
-		while (!events.empty() && events.top()->ymin <= y)
-		{
-			status.push_back(events.top());
-			events.pop();
-		}
-		status.erase(std::remove_if(status.begin(), status.end(), [y](edge *e)
-		{
-			return e->ymax < y;
-		}), status.end());
-		std::sort(status.begin(), status.end(), [](edge *u, edge *v) -> bool
-		{
-			return v->x > u->x;
-		});
+		while (next < n && events[next]->ymin <= y)
+			status[M++] = events[next++];
+		int m = 0;
+		for (int i = 0; i < M; ++i)
+			if (status[i]->ymax >= y)
+				status[m++] = status[i];
+		M = m;
+		for (int i = 1; i < M; ++i)
+			for (int k = i; k > 0 && status[k]->x < status[k - 1]->x; --k)
+				std::swap(status[k], status[k - 1]);
 		
-		int M = status.size();
 		for (int i = 0; i < M; i += 2)
 		{
 			unit xmin = status[i]->x;
@@ -198,15 +304,39 @@ void actPolygon(Fluid &fluid, Vec verts[N], Entity *ent)
 			if (xmin > (unit) width + 0.5) xmin = width + 0.5;
 			if (xmax > (unit) width + 0.5) xmax = width + 0.5;
 			
-			for (int x = round(xmin); x <= round(xmax); ++x)
-				fluid.p[IX(x, y)] = ent;
+			// Spans of a row can meet in a cell, which only one of them gets
+			int begin = round(xmin), end = round(xmax) + 1;
+			if (!out.empty() && out.back().j == y && begin < out.back().end)
+				begin = out.back().end;
+			if (begin < end)
+				out.push_back({y, begin, end});
 		}
 		
-		for (auto *e : status)
-			e->x += e->s;
+		for (int i = 0; i < M; ++i)
+			status[i]->x += status[i]->s;
 	}
 }
 
+static bool covered(const Spans &cells, int i, int j)
+{
+	Spans::const_iterator s = std::lower_bound(cells.begin(), cells.end(), j,
+		[](const Span &s, int j) { return s.j < j; });
+	for (; s != cells.end() && s->j == j; ++s)
+		if (i >= s->begin && i < s->end)
+			return true;
+	return false;
+}
+
+static bool same(const Spans &a, const Spans &b)
+{
+	if (a.size() != b.size())
+		return false;
+	for (size_t k = 0; k < a.size(); ++k)
+		if (a[k].j != b[k].j || a[k].begin != b[k].begin || a[k].end != b[k].end)
+			return false;
+	return true;
+}
+
 /*void actEdge(Fluid &fluid, ParticleBase &p1, ParticleBase &p2)
 {
 	const int &width = fluid.width;
@@ -240,8 +370,9 @@ int collidingCell(Fluid &fluid, int i, int j, unit x, unit y)
 {
 	const int &width = fluid.width;
 	const int &height = fluid.height;
-	unit fx = (unit) width / (fluid.sim->bounds.right - fluid.sim->bounds.left);
-	unit fy = (unit) height / (fluid.sim->bounds.bottom - fluid.sim->bounds.top);
+	const GUI::Rect bounds = fluid.area();
+	unit fx = (unit) width / (bounds.right - bounds.left);
+	unit fy = (unit) height / (bounds.bottom - bounds.top);
 
 	int l = abs((i - x) + (j - y)) + 1;
 	unit di = (i - x) / (unit) l;
@@ -250,11 +381,12 @@ int collidingCell(Fluid &fluid, int i, int j, unit x, unit y)
 	for (int k = 0; k <= l + 1; ++k)
 	{
 		m = IX((int) x, (int) y);
-		Quad *q = dynamic_cast<Quad *> (fluid.p[m]);
-		RigidBase *r = dynamic_cast<RigidBase *> (fluid.p[m]);
-		if (q || r)
+		if (fluid.p[m])
 		{
-			Vec o((x / fx) + fluid.sim->bounds.left, y / fy);
+			const Fluid::Body &body = fluid.bodies[fluid.p[m] - 1];
+			Quad *q = body.kind == Fluid::Cloth ? fluid.sim->getQuads()[body.index] : NULL;
+			RigidBase *r = body.kind == Fluid::Rigid ? fluid.sim->getRigids()[body.index] : NULL;
+			Vec o((x / fx) + bounds.left, (y / fy) + bounds.top);
 			Vec v(fluid.u[m] / fx, fluid.v[m] / fy);
 			if (q)
 			{
@@ -275,29 +407,58 @@ int collidingCell(Fluid &fluid, int i, int j, unit x, unit y)
 	return IX(i,j);
 }
 
-void couple(Fluid &fluid, unit dt)
+//------------------------------------------------------------------------------
+// Coupling. Cells on obstacles push on them, reflect the air and move their
+// density off them. The cells are worked on in parallel: each writes its
+// velocity and its part of the forces on its own, the forces are then summed
+// in cell order, and the density it moves off is what it held before any
+// moved. The moves reach two rows either way, so they are made in bands of
+// Band rows, every other band at once.
+
+void Fluid::couple()
 {
 	static const unit absorbtion = 0.6;
 	static const unit emission = 100.0;
-	const int &width = fluid.width;
-	const int &height = fluid.height;
-	unit fx = (unit) width / (fluid.sim->bounds.right - fluid.sim->bounds.left);
-	unit fy = (unit) height / (fluid.sim->bounds.bottom - fluid.sim->bounds.top);
+	const GUI::Rect bounds = area();
+	unit fx = (unit) width / (bounds.right - bounds.left);
+	unit fy = (unit) height / (bounds.bottom - bounds.top);
+	Quad **quads = sim->getQuads();
+	RigidBase **rigids = sim->getRigids();
 	
-	FOR_EACH_CELL(i, j)
-		Quad *q = dynamic_cast<Quad *> (fluid.p[IX(i, j)]);
-		RigidBase *r = dynamic_cast<RigidBase *> (fluid.p[IX(i, j)]);
-		if (q || r)
+	size_t k = 0;
+	const int bands = (height + 2 + Band - 1) / Band;
+	starts.assign(bands + 1, 0);
+	FOR_EACH_ACTIVE(i, j)
+		if (!p[IX(i, j)] || refined(i, j)) // The patches couple refined cells
+			continue;
+		if (k == contacts.size())
+			contacts.push_back(Contact());
+		contacts[k++].c = IX(i, j);
+		++starts[j / Band + 1];
+	END_FOR
+	if (!k)
+		return;
+	for (int b = 0; b < bands; ++b)
+		starts[b + 1] += starts[b];
+	
+	Threads::pool().parallel(k, [&](size_t begin, size_t end)
+	{
+		for (size_t m = begin; m < end; ++m)
 		{
-			Vec v(fluid.u[IX(i, j)], fluid.v[IX(i, j)]);
+			Contact &e = contacts[m];
+			const int i = e.c % (width + 2), j = e.c / (width + 2);
+			const Body &body = bodies[p[e.c] - 1];
+			Quad *q = body.kind == Cloth ? quads[body.index] : NULL;
+			RigidBase *r = body.kind == Rigid ? rigids[body.index] : NULL;
+			Vec w(u[e.c], v[e.c]);
 			Vec c = q ? q->center() : *r->x;
-			c = Vec((c.x - fluid.sim->bounds.left) * fx, c.y * fy);
+			c = Vec((c.x - bounds.left) * fx, (c.y - bounds.top) * fy);
 			Vec n = ~(Vec(i, j) - c);
 			
 			// Force
-			Vec px((i / fx) + fluid.sim->bounds.left, j / fy);
-			Vec pv(v.x / fx, v.y / fy);
-			unit d = fluid.d[IX(i, j)] / fluid.speed * emission;
+			Vec px((i / fx) + bounds.left, (j / fy) + bounds.top);
+			Vec pv(w.x / fx, w.y / fy);
+			unit dd = d[e.c] / speed * emission * share;
 			if (q)
 			{
 				unit q1 = (*q->p1->x - px).length2();
@@ -309,73 +470,96 @@ void couple(Fluid &fluid, unit dt)
 				q2 = 1.0 - (q2 / qs);
 				q3 = 1.0 - (q3 / qs);
 				q4 = 1.0 - (q4 / qs);
-				*q->p1->f -= (pv - *q->p1->v) * d * q1 / 25.0;
-				*q->p2->f -= (pv - *q->p2->v) * d * q2 / 25.0;
-				*q->p3->f -= (pv - *q->p3->v) * d * q3 / 25.0;
-				*q->p4->f -= (pv - *q->p4->v) * d * q4 / 25.0;
+				e.f[0] = (pv - *q->p1->v) * dd * q1 / 25.0;
+				e.f[1] = (pv - *q->p2->v) * dd * q2 / 25.0;
+				e.f[2] = (pv - *q->p3->v) * dd * q3 / 25.0;
+				e.f[3] = (pv - *q->p4->v) * dd * q4 / 25.0;
 			}
-			else if (r)
+			else
 			{
-				Vec f = (pv - *r->v) * d;
-				*r->f += f;
-				*r->t += (px - *r->x) & f;
+				e.f[0] = (pv - *r->v) * dd;
+				e.f[1].x = (px - *r->x) & e.f[0];
 			}
 			
 			// Reflection
-			v *= absorbtion;
-			if (v * n <= 0.0) // only reflect opposing forces
+			w *= absorbtion;
+			if (w * n <= 0.0) // only reflect opposing forces
 			{
-				v = v - 2.0 * (v * n) * n;
-				fluid.u[IX(i, j)] = v.x;
-				fluid.v[IX(i, j)] = v.y;
+				w = w - 2.0 * (w * n) * n;
+				u[e.c] = w.x;
+				v[e.c] = w.y;
 			}
 			
-			// De-advection
-			v = ~v;
-			int i0 = CLAMPX(i + v.x + 0.5);
-			int j0 = CLAMPY(j + v.y + 0.5);
-			int i1 = CLAMPX(i + v.x + n.x + 0.5);
-			int j1 = CLAMPY(j + v.y + n.y + 0.5);
-			fluid.d[IX(i0, j0)] += fluid.d[IX(i, j)] * 0.25;
-			fluid.d[IX(i0, j1)] += fluid.d[IX(i, j)] * 0.25;
-			fluid.d[IX(i1, j0)] += fluid.d[IX(i, j)] * 0.25;
-			fluid.d[IX(i1, j1)] += fluid.d[IX(i, j)] * 0.25;
-			unit miss = 0.0;
-			if (i == i0 && j == j0) miss += 0.25;
-			if (i == i0 && j == j1) miss += 0.25;
-			if (i == i1 && j == j0) miss += 0.25;
-			if (i == i1 && j == j1) miss += 0.25;
-			fluid.d[IX(i, j)] *= miss;
+			// De-advection, a quarter of the density to each of four cells
+			w = ~w;
+			int i0 = CLAMPX(i + w.x + 0.5);
+			int j0 = CLAMPY(j + w.y + 0.5);
+			int i1 = CLAMPX(i + w.x + n.x + 0.5);
+			int j1 = CLAMPY(j + w.y + n.y + 0.5);
+			e.to[0] = IX(i0, j0);
+			e.to[1] = IX(i0, j1);
+			e.to[2] = IX(i1, j0);
+			e.to[3] = IX(i1, j1);
+			e.share = d[e.c] * 0.25;
+			d[e.c] = 0.0;
 		}
-	END_FOR
+	});
+	
+	// Forces in cell order, as they were when cells were coupled one by one
+	for (size_t m = 0; m < k; ++m)
+	{
+		const Contact &e = contacts[m];
+		const Body &body = bodies[p[e.c] - 1];
+		if (body.kind == Cloth)
+		{
+			Quad *q = quads[body.index];
+			*q->p1->f -= e.f[0];
+			*q->p2->f -= e.f[1];
+			*q->p3->f -= e.f[2];
+			*q->p4->f -= e.f[3];
+		}
+		else
+		{
+			RigidBase *r = rigids[body.index];
+			*r->f += e.f[0];
+			*r->t += e.f[1].x;
+		}
+	}
+	
+	for (int colour = 0; colour < 2; ++colour)
+		Threads::pool().parallel((bands + 1 - colour) / 2, [&](size_t begin, size_t end)
+		{
+			for (size_t b = 2 * begin + colour; b < 2 * end + colour; b += 2)
+				for (size_t m = starts[b]; m < starts[b + 1]; ++m)
+					for (int t : contacts[m].to)
+						d[t] += contacts[m].share;
+		});
 }
 
 void Fluid::act(unit dt)
 {
-	const size_t size = (width + 2)*(height + 2);
+#ifdef FLUID_FLOAT
+	Simd::FlushDenormals flush;
+#endif
+	const unit step = dt;
 	
 	dt *= speed;
+	traffic = 0;
 	
-	// Reset, apply gravity
-	for (int i = 0; i < size; ++i)
-	{
-		u_old[i] = g.x * d[i];
-		v_old[i] = g.y * d[i];
-		d_old[i] = 0.0;
-		p[i] = NULL;
-	}
-
 	// Collisions
-	for (Quad **q = sim->getQuads(); *q; ++q)
+	size_t k = 0;
+	Quad **quads = sim->getQuads();
+	RigidBase **rigids = sim->getRigids();
+	for (Quad **q = quads; *q; ++q)
 	{
 		Vec ps[4] = {
 			*(*q)->p1->x,
 			*(*q)->p2->x,
 			*(*q)->p3->x,
 			*(*q)->p4->x};
-		actPolygon<4>(*this, ps, *q);
+		cover(k++, {Cloth, int(q - quads)}, ps);
 	}
-	for (RigidBase **r = sim->getRigids(); *r; ++r)
+	for (RigidBase **r = rigids; *r; ++r)
 	{
 		RigidBox *rb = dynamic_cast<RigidBox *> (*r);
 		if (!rb) continue;
@@ -386,8 +570,10 @@ void Fluid::act(unit dt)
 			(Vec(-cs,  cs) ^ n) + *(*r)->x,
 			(Vec( cs,  cs) ^ n) + *(*r)->x,
 			(Vec( cs, -cs) ^ n) + *(*r)->x};
-		actPolygon<4>(*this, ps, *r);
+		cover(k++, {Rigid, int(r - rigids)}, ps);
 	}
+	settle(k);
+	regrid();
 	
 	// Mouse interaction
 	{
@@ -399,144 +585,849 @@ void Fluid::act(unit dt)
 		if (j < 0) j = 0;
 		if (j >= height) j = height -1;
 		
-		u_old[IX(i,j)] += mouse.v.x;
-		v_old[IX(i,j)] += mouse.v.y;
-		d_old[IX(i,j)] += mouse.d;
+		source.cell = IX(i,j);
+		source.v = mouse.v;
+		source.d = mouse.d;
+		
+		// The patch under the mouse gets as much source per cell of this grid
+		for (Fluid *patch : patches)
+		{
+			const unit r = refine,
+				x = r * (width * mouse.pos.x - patch->offset_i - 0.5) + 0.5,
+				y = r * (height * mouse.pos.y - patch->offset_j - 0.5) + 0.5;
+			if (x >= 0.5 && x < patch->width + 0.5 && y >= 0.5 && y < patch->height + 0.5)
+			{
+				patch->mouse.pos = Vec(x / patch->width, y / patch->height);
+				patch->mouse.v += mouse.v * (r * r);
+				patch->mouse.d += mouse.d * (r * r);
+				break;
+			}
+		}
 		mouse.v = Vec();
 		mouse.d = 0;
 	}
 
-	vel_step(u, v, u_old, v_old, visc, dt);
-	dens_step(d, d_old, u, v, diff, dt);
-	couple(*this, dt);
+	mark();
+	projections = 0;
+	if (staggered())
+		mac_step(visc, dt);
+	else
+		vel_step(visc, dt);
+	dens_step(diff, dt);
+	couple();
+	for (Fluid *patch : patches)
+		patch->act(step);
+	for (Fluid *patch : patches)
+		coarsen(patch);
 }
 
 //------------------------------------------------------------------------------
 
-void Fluid::add_source(unit *x, unit *s, unit dt)
+void Fluid::set_bnd(int b, real *x)
+{
+	Sim::set_bnd(width, height, b, x);
+	if (!parent || (b == 0 && x != d && x != d_old))
+		return;
+	
+	// The edges of a patch inside the parent carry its velocity and density,
+	// edges on the walls of the parent keep the walls. Pressure (b = 3) is
+	// taken from the same projection of the parent all round.
+	const real *f = b == 1 ? parent->u : b == 2 ? parent->v : b == 3
+		? parent->kept[std::min(projections, 1)].data() : parent->d;
+	const int r = sx / parent->sx;
+	auto edge = [&](int i, int j)
+	{
+		const Vec c = outer(i, j);
+		x[IX(i, j)] = parent->sample(f, c.x, c.y);
+	};
+	const bool all = b == 3;
+	for (int i = 0; i <= width + 1; ++i)
+	{
+		if (all || offset_j > 0)
+			edge(i, 0);
+		if (all || offset_j + height / r < parent->height)
+			edge(i, height + 1);
+	}
+	for (int j = 0; j <= height + 1; ++j)
+	{
+		if (all || offset_i > 0)
+			edge(0, j);
+		if (all || offset_i + width / r < parent->width)
+			edge(width + 1, j);
+	}
+}
+
+void Fluid::lin_solve(int b, real *x, real *x0, unit a, unit c)
 {
-	int size = (width + 2) * (height + 2);
-	for (int i = 0; i < size; ++i)
-		x[i] += dt * s[i];
+	solver->cells = sparse ? &active : NULL;
+	solver->solve(b, x, x0, a, c);
+	solver->cells = NULL;
+	if (parent) // The solver leaves walls all round
+		set_bnd(b, x);
 }
 
-void Fluid::set_bnd(int b, unit *x)
+void Fluid::diffuse(int b, real *x, real *x0, unit diff, unit dt)
 {
-	const int &W = width;
-	const int &H = height;
-	
-	for (int i = 1; i <= W; ++i)
+	unit a = dt * diff * sx * sy;
+	lin_solve(b, x, x0, a, 1 + 4 * a);
+}
+
+/** Advects cells i up to end of row j a pack of cells at a time, returns the
+    first cell not done. Single precision grids take the twice as wide float
+    packs, so both work in real.
+    The operations match the scalar loop in advect, so without FMA contraction
+    the results are identical. */
+int advectRow(int width, int height, int j, int i, int end, real *d, const real *d0,
+	const real *u, const real *v, real ds0, real dt0)
+{
+#ifdef FLUID_FLOAT
+	using namespace Simd::Single;
+#else
+	using namespace Simd;
+#endif
+	const pack S = set(ds0), T = set(dt0), one = set(1.0), lo = set(0.5),
+		xmax = set(width + 0.5), ymax = set(height + 0.5), row = set(width + 2);
+	for (; i + Width <= end; i += Width)
 	{
-		x[IX(i, 0  )] = b == 2 ? -x[IX(i, 1)] : x[IX(i, 1)];
-		x[IX(i, H+1)] = b == 2 ? -x[IX(i, H)] : x[IX(i, H)];
+		const int n = IX(i, j);
+		pack x = sub(add(set(i), ramp()), mul(S, load(u + n)));
+		pack y = sub(set(j), mul(T, load(v + n)));
+		x = min(max(x, lo), xmax);
+		y = min(max(y, lo), ymax);
+		
+		pack i0 = trunc(x), j0 = trunc(y);
+		pack s1 = sub(x, i0), s0 = sub(one, s1);
+		pack t1 = sub(y, j0), t0 = sub(one, t1);
+		int k[Width];
+		index(k, add(i0, mul(row, j0)));
+		pack d00 = gather(d0, k), d01 = gather(d0 + width + 2, k);
+		pack d10 = gather(d0 + 1, k), d11 = gather(d0 + width + 3, k);
+		store(d + n, add(mul(s0, add(mul(t0, d00), mul(t1, d01))),
+			mul(s1, add(mul(t0, d10), mul(t1, d11)))));
 	}
-	for (int j = 1; j <= H; ++j)
+	return i;
+}
+
+void Fluid::advect(int b, real *d, real *d0, real *u, real *v, unit dt)
+{
+	int i0, j0, i1, j1;
+	real x, y, s0, t0, s1, t1, ds0, dt0;
+	ds0 = dt * sx;
+	dt0 = dt * sy;
+	for (const Span &span : active)
 	{
-		x[IX(0  , j)] = b == 1 ? -x[IX(1, j)] : x[IX(1, j)];
-		x[IX(W+1, j)] = b == 1 ? -x[IX(W, j)] : x[IX(W, j)];
+		const int j = span.j;
+		int i = span.begin;
+		if (Vectorised)
+			i = advectRow(width, height, j, i, span.end, d, d0, u, v, ds0, dt0);
+		for (; i < span.end; ++i)
+		{
+			x = i - ds0 * u[IX(i, j)];
+			y = j - dt0 * v[IX(i, j)];
+			
+			if (x < 0.5) x = 0.5;
+			if (x > width + 0.5) x = width + 0.5;
+			
+			i0 = (int) x;
+			i1 = i0 + 1;
+			
+			if (y < 0.5) y = 0.5;
+			if (y > height + 0.5) y = height + 0.5;
+			
+			j0 = (int) y;
+			j1 = j0 + 1;
+			s1 = x - i0;
+			s0 = 1 - s1;
+			t1 = y - j0;
+			t0 = 1 - t1;
+			d[IX(i, j)] =
+			//d[collidingCell(*this, i, j, x, y)] +=
+				s0 * (t0 * d0[IX(i0, j0)] + t1 * d0[IX(i0, j1)]) +
+				s1 * (t0 * d0[IX(i1, j0)] + t1 * d0[IX(i1, j1)]);
+		}
 	}
-	
-	x[IX(0  , 0  )] = 0.5 * (x[IX(1, 0  )] + x[IX(0  , 1)]);
-	x[IX(0  , H+1)] = 0.5 * (x[IX(1, H+1)] + x[IX(0  , H)]);
-	x[IX(W+1, 0  )] = 0.5 * (x[IX(W, 0  )] + x[IX(W+1, 1)]);
-	x[IX(W+1, H+1)] = 0.5 * (x[IX(W, H+1)] + x[IX(W+1, H)]);
+	traffic += 4 * cells * sizeof(real);
+	set_bnd(b, d);
 }
 
-void Fluid::lin_solve(int b, unit *x, unit *x0, unit a, unit c)
+void Fluid::project(real *u, real *v, real *p, real *div)
 {
-	for (int k = 0 ; k < 20 ; k++)
+	const size_t size = (width + 2)*(height + 2);
+	if (sparse)
 	{
+		std::fill(div, div + size, 0.0);
+		std::fill(p, p + size, 0.0);
+	}
+	// No guess in sparse mode: carried over pressure would push velocity into
+	// the quiet tiles around the active ones and wake the whole grid
+	const std::vector<real> &last = kept[std::min(projections, 1)];
+	const bool guess = warm && !sparse && last.size() == size;
+	FOR_EACH_ACTIVE(i, j)
+		div[IX(i, j)] = -0.5 * (u[IX(i + 1, j)] - u[IX(i - 1, j)] + v[IX(i, j + 1)] - v[IX(i, j - 1)]) / sy;
+		p[IX(i, j)] = guess ? last[IX(i, j)] : 0;
+	END_FOR
+	if (parent && !guess) // A new patch starts from the pressure of its parent
+	{
+		const real *q = parent->kept[std::min(projections, 1)].data();
 		FOR_EACH_CELL(i, j)
-			x[IX(i, j)] = (x0[IX(i, j)] + a * (x[IX(i - 1, j)] + x[IX(i + 1, j)]
-				+ x[IX(i, j - 1)] + x[IX(i, j + 1)])) / c;
+			const Vec c = outer(i, j);
+			p[IX(i, j)] = parent->sample(q, c.x, c.y);
 		END_FOR
-		set_bnd(b, x);
 	}
+	set_bnd(0, div);
+	set_bnd(parent ? 3 : 0, p);
+	lin_solve(parent ? 3 : 0, p, div, 1, 4);
+	pressure = solver->stats;
+	if (pressure.residual < 0.0)
+		pressure.residual = solver->residual(p, div, 1, 4);
+	keep(p);
+	FOR_EACH_ACTIVE(i, j)
+		u[IX(i, j)] -= 0.5 * sx * (p[IX(i + 1, j)] - p[IX(i - 1, j)]);
+		v[IX(i, j)] -= 0.5 * sy * (p[IX(i, j + 1)] - p[IX(i, j - 1)]);
+	END_FOR
+	traffic += (guess ? 10 : 9) * cells * sizeof(real);
+	set_bnd(1, u);
+	set_bnd(2, v);
+	
+	// Solvers that ignore the active cells also fill in the empty tiles
+	for (size_t t = 0; t < tiles.size(); ++t)
+		if (!tiles[t])
+		{
+			clearTile(t, p);
+			clearTile(t, div);
+		}
 }
 
-void Fluid::diffuse(int b, unit *x, unit *x0, unit diff, unit dt)
+void Fluid::dens_step(unit diff, unit dt)
 {
-	unit a = dt * diff * width * height;
-	lin_solve(b, x, x0, a, 1 + 4 * a);
+	// The only density source is the mouse; without diffusion the density
+	// is advected as it is
+	d[source.cell] += dt * source.d;
+	if (diff > 0.0)
+		diffuse(0, d_old, d, diff, dt);
+	else
+	{
+		std::swap(d, d_old);
+		set_bnd(0, d_old);
+	}
+	advect(0, d, d_old, u, v, dt);
 }
 
-void Fluid::advect(int b, unit *d, unit *d0, unit *u, unit *v, unit dt)
+void Fluid::vel_step(unit visc, unit dt)
 {
-	int i0, j0, i1, j1;
-	unit x, y, s0, t0, s1, t1, ds0, dt0;
-	ds0 = dt * width;
-	dt0 = dt * height;
+	// Sources, gravity on the density and the mouse, in one pass that leaves
+	// the old grids with the velocity to diffuse
+	FOR_EACH_ACTIVE(i, j)
+		const int n = IX(i, j);
+		u_old[n] = u[n] + dt * (g.x * d[n]);
+		v_old[n] = v[n] + dt * (g.y * d[n]);
+	END_FOR
+	traffic += 5 * cells * sizeof(real);
+	u_old[source.cell] += dt * source.v.x;
+	v_old[source.cell] += dt * source.v.y;
+	
+	if (visc > 0.0)
+	{
+		diffuse(1, u, u_old, visc, dt);
+		diffuse(2, v, v_old, visc, dt);
+	}
+	else // Diffusion would leave them as they are
+	{
+		std::swap(u, u_old);
+		std::swap(v, v_old);
+		set_bnd(1, u);
+		set_bnd(2, v);
+	}
+	project(u, v, u_old, v_old);
+	std::swap(u, u_old);
+	std::swap(v, v_old);
+	advect(1, u, u_old, u_old, v_old, dt);
+	advect(2, v, v_old, u_old, v_old, dt);
+	project(u, v, u_old, v_old);
+}
+
+//------------------------------------------------------------------------------
+// Obstacles. Each body's footprint, the cells it covers as spans by row, is
+// kept from the last step, and a body only writes to `p` when its footprint
+// changes. A cell belongs to the last body covering it, in the order the
+// simulation lists them; every cell keeps a list of the bodies covering it, so
+// that cells a body leaves go to whatever still covers them. Cells hold the
+// body's place in `bodies` plus one, which is also the order they are listed.
+
+void Fluid::cover(size_t k, Body body, const Vec *verts)
+{
+	rasterize<4>(*this, verts, footprint);
+	if (k >= bodies.size())
+	{
+		bodies.push_back({Nothing, 0});
+		footprints.push_back(Spans());
+	}
+	Body &b = bodies[k];
+	Spans &cells = footprints[k];
+	if (b.kind == body.kind && b.index == body.index && same(cells, footprint))
+		return;
+	
+	// Only the cells that the body leaves or enters change, unless it is
+	// another body than last step
+	const int id = k + 1;
+	if (b.kind != body.kind || b.index != body.index)
+	{
+		uncover(k);
+		cells.clear();
+		b = body;
+	}
+	for (const Span &s : cells)
+		for (int i = s.begin; i < s.end; ++i)
+			if (!covered(footprint, i, s.j))
+				unlink(IX(i, s.j), id);
+	for (const Span &s : footprint)
+		for (int i = s.begin; i < s.end; ++i)
+			if (!covered(cells, i, s.j))
+				link(IX(i, s.j), id);
+	cells.swap(footprint);
+}
+
+void Fluid::uncover(size_t k)
+{
+	for (const Span &s : footprints[k])
+		for (int i = s.begin; i < s.end; ++i)
+			unlink(IX(i, s.j), k + 1);
+}
+
+void Fluid::link(int c, int id)
+{
+	int l = spare;
+	if (l < 0)
+	{
+		l = links.size();
+		links.push_back(Link());
+	}
+	else
+		spare = links[l].next;
+	links[l] = {id, covers[c]};
+	covers[c] = l;
+	if (p[c] < id)
+		p[c] = id;
+}
+
+void Fluid::unlink(int c, int id)
+{
+	int *l = &covers[c];
+	while (links[*l].id != id)
+		l = &links[*l].next;
+	const int gone = *l;
+	*l = links[gone].next;
+	links[gone].next = spare;
+	spare = gone;
+	if (p[c] == id)
+	{
+		p[c] = 0;
+		vacated.push_back(c);
+	}
+}
+
+void Fluid::settle(size_t count)
+{
+	while (bodies.size() > count)
+	{
+		uncover(bodies.size() - 1);
+		bodies.pop_back();
+		footprints.pop_back();
+	}
+	
+	for (int c : vacated)
+		for (int l = covers[c]; l >= 0; l = links[l].next)
+			if (links[l].id > p[c])
+				p[c] = links[l].id;
+	vacated.clear();
+}
+
+//------------------------------------------------------------------------------
+// Sparse mode. The grid is split in tiles of Tile x Tile cells; a tile is
+// active when it holds density, velocity above `still`, a source or an
+// obstacle, or borders such a tile (the halo). The kernels only run on active
+// cells, and all grids are kept zero elsewhere: tiles are cleared when they
+// drop out. The empty tiles act as still air with zero pressure.
+
+void Fluid::mark()
+{
+	active.clear();
+	if (!sparse || staggered())
+	{
+		tiles.clear();
+		for (int j = 1; j <= height; ++j)
+			active.push_back({j, 1, width + 1});
+		cells = width * height;
+		return;
+	}
+	
+	const int tw = (width + Tile - 1) / Tile, th = (height + Tile - 1) / Tile;
+	std::vector<char> used(tw * th, 0);
 	FOR_EACH_CELL(i, j)
-		x = i - ds0 * u[IX(i, j)];
-		y = j - dt0 * v[IX(i, j)];
-		
-		if (x < 0.5) x = 0.5;
-		if (x > width + 0.5) x = width + 0.5;
-		
-		i0 = (int) x;
-		i1 = i0 + 1;
-		
-		if (y < 0.5) y = 0.5;
-		if (y > height + 0.5) y = height + 0.5;
-		
-		j0 = (int) y;
-		j1 = j0 + 1;
-		s1 = x - i0;
-		s0 = 1 - s1;
-		t1 = y - j0;
-		t0 = 1 - t1;
-		d[IX(i, j)] =
-		//d[collidingCell(*this, i, j, x, y)] +=
-			s0 * (t0 * d0[IX(i0, j0)] + t1 * d0[IX(i0, j1)]) +
-			s1 * (t0 * d0[IX(i1, j0)] + t1 * d0[IX(i1, j1)]);
+		const int n = IX(i, j);
+		if (fabs(d[n]) > Negligible || fabs(u[n]) > still || fabs(v[n]) > still
+			|| fabs(g.x * d[n]) > Negligible || fabs(g.y * d[n]) > Negligible || p[n])
+			used[(i - 1) / Tile + tw * ((j - 1) / Tile)] = 1;
+	END_FOR
+	const int s = source.cell;
+	if (fabs(source.d) > Negligible || fabs(source.v.x) > Negligible
+		|| fabs(source.v.y) > Negligible)
+		used[(s % (width + 2) - 1) / Tile + tw * ((s / (width + 2) - 1) / Tile)] = 1;
+	traffic += 4 * width * height * sizeof(real);
+	
+	std::vector<char> on(tw * th, 0);
+	for (int tj = 0; tj < th; ++tj)
+		for (int ti = 0; ti < tw; ++ti)
+			if (used[ti + tw * tj])
+				for (int y = std::max(tj - 1, 0); y <= std::min(tj + 1, th - 1); ++y)
+					for (int x = std::max(ti - 1, 0); x <= std::min(ti + 1, tw - 1); ++x)
+						on[x + tw * y] = 1;
+	
+	// Tiles that drop out are cleared, so that empty tiles stay zero
+	if (tiles.size() != on.size())
+		tiles.assign(on.size(), 1);
+	for (int t = 0; t < tw * th; ++t)
+		if (tiles[t] && !on[t])
+		{
+			clearTile(t, u);
+			clearTile(t, v);
+			clearTile(t, d);
+			clearTile(t, u_old);
+			clearTile(t, v_old);
+			clearTile(t, d_old);
+		}
+	tiles.swap(on);
+	
+	// Runs of active tiles, row by row
+	for (int j = 1; j <= height; ++j)
+	{
+		const char *row = &tiles[tw * ((j - 1) / Tile)];
+		for (int ti = 0; ti < tw; )
+		{
+			if (!row[ti])
+			{
+				++ti;
+				continue;
+			}
+			int end = ti;
+			while (end < tw && row[end])
+				++end;
+			active.push_back({j, 1 + Tile * ti, std::min(width, Tile * end) + 1});
+			ti = end;
+		}
+	}
+	cells = 0;
+	for (const Span &span : active)
+		cells += span.end - span.begin;
+}
 
+void Fluid::clearTile(int t, real *x)
+{
+	const int tw = (width + Tile - 1) / Tile, ti = t % tw, tj = t / tw;
+	for (int j = 1 + Tile * tj; j <= std::min(height, Tile * (tj + 1)); ++j)
+		for (int i = 1 + Tile * ti; i <= std::min(width, Tile * (ti + 1)); ++i)
+			x[IX(i, j)] = 0.0;
+}
+
+//------------------------------------------------------------------------------
+// Nested grid. Where obstacles are or the vorticity exceeds `curl`, patches
+// with `refine` times as many cells per side are laid over the grid, with a
+// margin. The cells that need refining mark the blocks of Block x Block cells
+// they lie in, and the marked blocks are split into boxes that are mostly
+// marked, so that cells far apart get patches of their own rather than one
+// patch over everything between them. Each patch steps after this grid, takes
+// its edges from it, couples the obstacles under it in its place, and its
+// cells are averaged back into the cells of this grid they cover. The patches
+// are only replaced when what needs refinement leaves them, or takes up much
+// less than they do.
+
+namespace {
+
+struct Box
+{
+	int i0, j0, i1, j1; // Inclusive
+};
+
+/** Splits the marked blocks of box, in a map bw blocks wide, into boxes with at
+    least Fill of their blocks marked, in the manner of Berger and Rigoutsos:
+    at a row or column without marks, else where the marks per row or column
+    bend the most, else in half. */
+void cluster(const std::vector<char> &marks, int bw, Box box, std::vector<Box> &out)
+{
+	// Shrink to the marks, counting them per column and row
+	std::vector<int> cols(box.i1 - box.i0 + 1, 0), rows(box.j1 - box.j0 + 1, 0);
+	int n = 0;
+	for (int j = box.j0; j <= box.j1; ++j)
+		for (int i = box.i0; i <= box.i1; ++i)
+			if (marks[i + bw * j])
+			{
+				++cols[i - box.i0];
+				++rows[j - box.j0];
+				++n;
+			}
+	if (!n)
+		return;
+	int a0 = 0, a1 = cols.size() - 1, b0 = 0, b1 = rows.size() - 1;
+	while (!cols[a0]) ++a0;
+	while (!cols[a1]) --a1;
+	while (!rows[b0]) ++b0;
+	while (!rows[b1]) --b1;
+	cols.assign(cols.begin() + a0, cols.begin() + a1 + 1);
+	rows.assign(rows.begin() + b0, rows.begin() + b1 + 1);
+	box = {box.i0 + a0, box.j0 + b0, box.i0 + a1, box.j0 + b1};
+	const int w = cols.size(), h = rows.size();
+	if (n >= Fill * w * h)
+	{
+		out.push_back(box);
+		return;
+	}
+	
+	// Cut before block k of the columns (x) or the rows
+	int k = 0;
+	bool x = true;
+	auto hole = [&](const std::vector<int> &s, bool along)
+	{
+		for (size_t m = 1; !k && m + 1 < s.size(); ++m)
+			if (!s[m])
+			{
+				k = m;
+				x = along;
+			}
+	};
+	hole(w >= h ? cols : rows, w >= h);
+	hole(w >= h ? rows : cols, w < h);
+	if (!k)
+	{
+		int most = 0;
+		auto bend = [&](const std::vector<int> &s, bool along)
+		{
+			for (int m = 1; m + 2 < (int) s.size(); ++m)
+			{
+				const int d0 = s[m - 1] - 2 * s[m] + s[m + 1],
+					d1 = s[m] - 2 * s[m + 1] + s[m + 2];
+				if ((d0 < 0) != (d1 < 0) && abs(d1 - d0) > most)
+				{
+					most = abs(d1 - d0);
+					k = m + 1;
+					x = along;
+				}
+			}
+		};
+		bend(cols, true);
+		bend(rows, false);
+	}
+	if (!k)
+	{
+		x = w >= h;
+		k = (x ? w : h) / 2;
+	}
+	if (x)
+	{
+		cluster(marks, bw, {box.i0, box.j0, box.i0 + k - 1, box.j1}, out);
+		cluster(marks, bw, {box.i0 + k, box.j0, box.i1, box.j1}, out);
+	}
+	else
+	{
+		cluster(marks, bw, {box.i0, box.j0, box.i1, box.j0 + k - 1}, out);
+		cluster(marks, bw, {box.i0, box.j0 + k, box.i1, box.j1}, out);
+	}
+}
+
+} /* namespace */
+
+void Fluid::regrid()
+{
+	if (refine < 2)
+	{
+		for (Fluid *patch : patches)
+			delete patch;
+		patches.clear();
+		return;
+	}
+	
+	// Mark the blocks within Margin of the cells that need refining with 1,
+	// and those only within Margin + Slack with 2
+	const int bw = (width + Block - 1) / Block, bh = (height + Block - 1) / Block;
+	std::vector<char> marks(bw * bh, 0);
+	FOR_EACH_CELL(i, j)
+		const unit w = 0.5 * (sx * (v[IX(i + 1, j)] - v[IX(i - 1, j)])
+			- sy * (u[IX(i, j + 1)] - u[IX(i, j - 1)]));
+		if (!p[IX(i, j)] && fabs(w) <= curl)
+			continue;
+		for (int b = std::max(j - 1 - Margin - Slack, 0) / Block;
+			b <= std::min(j - 1 + Margin + Slack, height - 1) / Block; ++b)
+			for (int a = std::max(i - 1 - Margin - Slack, 0) / Block;
+				a <= std::min(i - 1 + Margin + Slack, width - 1) / Block; ++a)
+			{
+				char &m = marks[a + bw * b];
+				const bool near = Block * (b + 1) > j - 1 - Margin && Block * b <= j - 1 + Margin
+					&& Block * (a + 1) > i - 1 - Margin && Block * a <= i - 1 + Margin;
+				if (m != 1)
+					m = near ? 1 : 2;
+			}
 	END_FOR
-	set_bnd(b, d);
+	std::vector<Box> boxes;
+	cluster(marks, bw, {0, 0, bw - 1, bh - 1}, boxes);
+	
+	// The patches are made of blocks, so they hold a block if they hold its
+	// first cell
+	bool keep = !patches.empty() && patches[0]->sx == refine * sx;
+	for (int b = 0; keep && b < bh; ++b)
+		for (int a = 0; keep && a < bw; ++a)
+			keep = marks[a + bw * b] != 1 || refined(Block * a + 1, Block * b + 1);
+	int area = 0, was = 0;
+	for (const Box &box : boxes)
+		area += (box.i1 - box.i0 + 1) * (box.j1 - box.j0 + 1) * Block * Block;
+	for (const Fluid *patch : patches)
+		was += patch->width * patch->height / (refine * refine);
+	if (keep && was < 2 * area)
+		return;
+	
+	std::vector<Fluid *> old;
+	old.swap(patches);
+	for (const Box &box : boxes)
+		place(Block * box.i0 + 1, Block * box.j0 + 1,
+			std::min(Block * (box.i1 + 1), width), std::min(Block * (box.j1 + 1), height), old);
+	for (Fluid *patch : old)
+		delete patch;
+}
+
+/** Lays a patch over cells i0 to i1 and j0 to j1, taking it from old if one
+    there already covers just those */
+void Fluid::place(int i0, int j0, int i1, int j1, std::vector<Fluid *> &old)
+{
+	for (auto it = old.begin(); it != old.end(); ++it)
+		if ((*it)->sx == refine * sx && (*it)->offset_i == i0 - 1 && (*it)->offset_j == j0 - 1
+			&& (*it)->width == refine * (i1 - i0 + 1) && (*it)->height == refine * (j1 - j0 + 1))
+		{
+			patches.push_back(*it);
+			old.erase(it);
+			return;
+		}
+	
+	Fluid *next = new Fluid(sim, refine * (i1 - i0 + 1), refine * (j1 - j0 + 1),
+		visc, diff, g, speed);
+	next->setSolver(solver->resized(next->width, next->height));
+	next->parent = this;
+	next->offset_i = i0 - 1;
+	next->offset_j = j0 - 1;
+	next->share = 1.0 / (refine * refine);
+	next->sx = refine * sx;
+	next->sy = refine * sy;
+	next->mouse.pos = Vec();
+	next->mouse.v = Vec();
+	next->mouse.d = 0.0;
+	patches.push_back(next);
+	
+	// Cells carry over from the old patches where they overlap, and are
+	// interpolated from this grid elsewhere. So do the pressures kept last
+	// step, that the projections start from.
+	const size_t size = (next->width + 2) * (next->height + 2);
+	for (int k = 0; k < 2; ++k)
+		if (kept[k].size() == (size_t) (width + 2) * (height + 2))
+			next->kept[k].resize(size);
+	for (int j = 0; j <= next->height + 1; ++j)
+		for (int i = 0; i <= next->width + 1; ++i)
+		{
+			const int n = i + (next->width + 2) * j;
+			const Fluid *from = NULL;
+			int m = 0;
+			for (const Fluid *patch : old)
+			{
+				const int I = i + refine * (next->offset_i - patch->offset_i),
+					J = j + refine * (next->offset_j - patch->offset_j);
+				if (patch->sx == next->sx && I >= 1 && J >= 1
+					&& I <= patch->width && J <= patch->height)
+				{
+					from = patch;
+					m = I + (patch->width + 2) * J;
+					break;
+				}
+			}
+			const Vec c = next->outer(i, j);
+			for (int k = 0; k < 2; ++k)
+			{
+				if (next->kept[k].empty())
+					continue;
+				next->kept[k][n] = from && from->kept[k].size() > (size_t) m
+					? from->kept[k][m] : sample(kept[k].data(), c.x, c.y);
+			}
+			if (from)
+			{
+				next->u[n] = from->u[m];
+				next->v[n] = from->v[m];
+				next->d[n] = from->d[m];
+				continue;
+			}
+			next->u[n] = sample(u, c.x, c.y);
+			next->v[n] = sample(v, c.x, c.y);
+			next->d[n] = sample(d, c.x, c.y);
+		}
+}
+
+void Fluid::keep(const real *p, unit scale)
+{
+	if (projections < 2)
+	{
+		kept[projections].assign(p, p + (width + 2) * (height + 2));
+		if (scale != 1.0)
+			for (real &x : kept[projections])
+				x *= scale;
+	}
+	++projections;
+}
+
+void Fluid::coarsen(const Fluid *patch)
+{
+	const int r = refine, row = patch->width + 2;
+	const unit w = 1.0 / (r * r);
+	for (int b = 1; b <= patch->height / r; ++b)
+		for (int a = 1; a <= patch->width / r; ++a)
+		{
+			unit su = 0.0, sv = 0.0, sd = 0.0;
+			for (int j = r * (b - 1) + 1; j <= r * b; ++j)
+				for (int i = r * (a - 1) + 1; i <= r * a; ++i)
+				{
+					su += patch->u[i + row * j];
+					sv += patch->v[i + row * j];
+					sd += patch->d[i + row * j];
+				}
+			const int n = IX(patch->offset_i + a, patch->offset_j + b);
+			u[n] = su * w;
+			v[n] = sv * w;
+			d[n] = sd * w;
+		}
 }
 
-void Fluid::project(unit *u, unit *v, unit *p, unit *div)
+/** Cell coordinates in the parent of cell (i, j) of a patch: its cells lie
+    evenly over the cells of the parent they cover. */
+Vec Fluid::outer(int i, int j) const
 {
+	const unit r = sx / parent->sx;
+	return Vec(offset_i + 0.5 + (i - 0.5) / r, offset_j + 0.5 + (j - 0.5) / r);
+}
+
+/** Bilinear interpolation of x at cell coordinates (i, j). */
+unit Fluid::sample(const real *x, unit i, unit j) const
+{
+	i = std::min(std::max(i, 0.5), width + 0.5);
+	j = std::min(std::max(j, 0.5), height + 0.5);
+	const int i0 = (int) i, j0 = (int) j;
+	const unit s1 = i - i0, s0 = 1 - s1, t1 = j - j0, t0 = 1 - t1;
+	return s0 * (t0 * x[IX(i0, j0)] + t1 * x[IX(i0, j0 + 1)]) +
+		s1 * (t0 * x[IX(i0 + 1, j0)] + t1 * x[IX(i0 + 1, j0 + 1)]);
+}
+
+//------------------------------------------------------------------------------
+// Staggered (MAC) velocities. uf[IX(i, j)] lives on the face between cells i
+// and i + 1, vf[IX(i, j)] on the face between cells j and j + 1; faces 0 and
+// width (height) are the closed walls. Velocities are scaled by the grid size
+// into cells per unit of time, so that the divergence of the faces and the
+// gradient of the pressure are exact adjoints, and the projection leaves no
+// divergence beyond what the solver leaves in the pressure.
+
+void Fluid::mac_advect(real *uf, real *vf, real *uf0, real *vf0, unit dt)
+{
+	unit ds0 = dt * sx, dt0 = dt * sy;
+	
+	// Bilinear sample of face grid f at (x, y), in its own indices
+	auto sample = [this](const real *f, unit x, unit y) -> unit
+	{
+		int i0 = (int) x, j0 = (int) y;
+		unit s1 = x - i0, s0 = 1 - s1, t1 = y - j0, t0 = 1 - t1;
+		return s0 * (t0 * f[IX(i0, j0)] + t1 * f[IX(i0, j0 + 1)]) +
+			s1 * (t0 * f[IX(i0 + 1, j0)] + t1 * f[IX(i0 + 1, j0 + 1)]);
+	};
+	
+	FOR_EACH_CELL(i, j)
+		if (i < width)
+		{
+			unit vy = 0.25 * (vf0[IX(i, j - 1)] + vf0[IX(i, j)]
+				+ vf0[IX(i + 1, j - 1)] + vf0[IX(i + 1, j)]);
+			unit x = std::min(std::max(i - ds0 * uf0[IX(i, j)], 0.0), (unit) width);
+			unit y = std::min(std::max(j - dt0 * vy, 1.0), (unit) height);
+			uf[IX(i, j)] = sample(uf0, x, y);
+		}
+		if (j < height)
+		{
+			unit ux = 0.25 * (uf0[IX(i - 1, j)] + uf0[IX(i, j)]
+				+ uf0[IX(i - 1, j + 1)] + uf0[IX(i, j + 1)]);
+			unit x = std::min(std::max(i - ds0 * ux, 1.0), (unit) width);
+			unit y = std::min(std::max(j - dt0 * vf0[IX(i, j)], 0.0), (unit) height);
+			vf[IX(i, j)] = sample(vf0, x, y);
+		}
+	END_FOR
+	traffic += 8 * cells * sizeof(real);
+}
+
+void Fluid::mac_project(real *p, real *div)
+{
+	const std::vector<real> &last = kept[std::min(projections, 1)];
+	const bool guess = warm && last.size() == (size_t) (width + 2)*(height + 2);
 	FOR_EACH_CELL(i, j)
-		div[IX(i, j)] = -0.5 * (u[IX(i + 1, j)] - u[IX(i - 1, j)] + v[IX(i, j + 1)] - v[IX(i, j - 1)]) / height;
-		p[IX(i, j)] = 0;
+		div[IX(i, j)] = -(sx * (uf[IX(i, j)] - uf[IX(i - 1, j)])
+			+ sy * (vf[IX(i, j)] - vf[IX(i, j - 1)]));
+		p[IX(i, j)] = guess ? last[IX(i, j)] * (sx * sy) : 0;
 	END_FOR
 	set_bnd(0, div);
 	set_bnd(0, p);
 	lin_solve(0, p, div, 1, 4);
+	pressure = solver->stats;
+	if (pressure.residual < 0.0)
+		pressure.residual = solver->residual(p, div, 1, 4);
+	keep(p, 1.0 / (sx * sy)); // To the scale of the cell velocities
 	FOR_EACH_CELL(i, j)
-		u[IX(i, j)] -= 0.5 * width * (p[IX(i + 1, j)] - p[IX(i - 1, j)]);
-		v[IX(i, j)] -= 0.5 * height * (p[IX(i, j + 1)] - p[IX(i, j - 1)]);
+		if (i < width) uf[IX(i, j)] -= (p[IX(i + 1, j)] - p[IX(i, j)]) / sx;
+		if (j < height) vf[IX(i, j)] -= (p[IX(i, j + 1)] - p[IX(i, j)]) / sy;
 	END_FOR
-	set_bnd(1, u);
-	set_bnd(2, v);
+	traffic += (guess ? 10 : 9) * cells * sizeof(real);
 }
 
-void Fluid::dens_step(unit *x, unit *x0, unit *u, unit *v, unit diff, unit dt)
+void Fluid::mac_step(unit visc, unit dt)
 {
-	add_source(x, x0, dt);
-	SWAP(x0, x);
-	diffuse(0, x, x0, diff, dt);
-	SWAP(x0, x);
 	const size_t size = (width + 2)*(height + 2);
-	for (int i = 0; i < size; ++i)
-		x[i] = 0.0;
-	advect(0, x, x0, u, v, dt);
-}
-
-void Fluid::vel_step(unit *u, unit *v, unit *u0, unit *v0, unit visc, unit dt)
-{
-	add_source(u, u0, dt);
-	add_source(v, v0, dt);
-	SWAP(u0, u);
-	diffuse(1, u, u0, visc, dt);
-	SWAP(v0, v);
-	diffuse(2, v, v0, visc, dt);
-	project(u, v, u0, v0);
-	SWAP(u0, u);
-	SWAP(v0, v);
-	advect(1, u, u0, u0, v0, dt);
-	advect(2, v, v0, u0, v0, dt);
-	project(u, v, u0, v0);
+	
+	// Sources, and whatever couple() did to the cell velocities since the
+	// last step, moved onto the faces
+	FOR_EACH_CELL(i, j)
+		u_old[IX(i, j)] = dt * (g.x * d[IX(i, j)]) + u[IX(i, j)]
+			- 0.5 * (uf[IX(i - 1, j)] + uf[IX(i, j)]);
+		v_old[IX(i, j)] = dt * (g.y * d[IX(i, j)]) + v[IX(i, j)]
+			- 0.5 * (vf[IX(i, j - 1)] + vf[IX(i, j)]);
+	END_FOR
+	u_old[source.cell] += dt * source.v.x;
+	v_old[source.cell] += dt * source.v.y;
+	FOR_EACH_CELL(i, j)
+		if (i < width) uf[IX(i, j)] += 0.5 * (u_old[IX(i, j)] + u_old[IX(i + 1, j)]);
+		if (j < height) vf[IX(i, j)] += 0.5 * (v_old[IX(i, j)] + v_old[IX(i, j + 1)]);
+	END_FOR
+	traffic += 13 * cells * sizeof(real);
+	
+	if (visc > 0.0)
+	{
+		SWAP(uf0, uf);
+		diffuse(1, uf, uf0, visc, dt);
+		SWAP(vf0, vf);
+		diffuse(2, vf, vf0, visc, dt);
+		for (int j = 0; j <= height + 1; ++j)
+			uf[IX(0, j)] = uf[IX(width, j)] = uf[IX(width + 1, j)] = 0.0;
+		for (int i = 0; i <= width + 1; ++i)
+			vf[IX(i, 0)] = vf[IX(i, height)] = vf[IX(i, height + 1)] = 0.0;
+	}
+	mac_project(u_old, v_old);
+	std::copy(uf, uf + size, uf0);
+	std::copy(vf, vf + size, vf0);
+	traffic += 4 * size * sizeof(real);
+	mac_advect(uf, vf, uf0, vf0, dt);
+	mac_project(u_old, v_old);
+	
+	FOR_EACH_CELL(i, j)
+		u[IX(i, j)] = 0.5 * (uf[IX(i - 1, j)] + uf[IX(i, j)]);
+		v[IX(i, j)] = 0.5 * (vf[IX(i, j - 1)] + vf[IX(i, j)]);
+	END_FOR
+	traffic += 4 * cells * sizeof(real);
+	set_bnd(1, u);
+	set_bnd(2, v);
 }
 
 //------------------------------------------------------------------------------
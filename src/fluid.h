@@ -13,6 +13,7 @@
 #include "base.h"
 #include "core.h"
 #include "sim.h"
+#include "solvers.h"
 
 namespace Sim {
 
@@ -22,16 +23,38 @@ class Fluid : public Entity, virtual public Drawable, virtual public Actor
 {
 public:
 	static bool VelocityMode;
+	static bool Vectorised; // Use the SIMD advection kernel
 	
 	Simulation *sim;
 	const int width, height;
 	unit visc, diff;
 	unit speed;
 	Vec g;
-	unit *u, *u_old; // velocity x
-	unit *v, *v_old; // velocity y
-	unit *d, *d_old; // density
-	Entity **p; // Particles (or not)
+	real *u, *u_old; // velocity x
+	real *v, *v_old; // velocity y
+	real *d, *d_old; // density
+	real *uf, *vf; // Staggered mode: velocity x at (i + 1/2, j), y at (i, j + 1/2)
+	enum Kind { Nothing, Cloth, Rigid };
+	struct Body
+	{
+		Kind kind;
+		int index; // In the simulation's quads or rigid bodies
+	};
+	int *p; // Obstacle of each cell: its place in bodies plus one, 0 for none
+	std::vector<Body> bodies; // Obstacles rasterised last step
+	bool warm; // Start pressure solves from the last step's pressure, default on; not when sparse
+	bool sparse; // Skip tiles without density, velocity or obstacles
+	unit still; // Sparse mode: slower air counts as still, default 1e-3
+	Spans active; // Cells the kernels run on, by row; all of them unless sparse
+	int refine; // Nested grid: patch cells per cell side, 0 (default) for off
+	unit curl; // Nested grid: vorticity that gets refined, default 40
+	std::vector<Fluid *> patches; // Nested grid: the refined patches, apart, owned
+	Fluid *parent; // Of a patch, else NULL
+	int offset_i, offset_j; // Of a patch: cells of the parent left and above it
+	unit share; // Of a cell in the force on obstacles, 1 / refine^2 in a patch
+	LinearSolver *solver; // For diffusion and pressure, owned
+	LinearSolver::Stats pressure; // Of the last pressure solve, residual always measured
+	size_t traffic; // Bytes of grid the last step's kernels streamed, solves not counted
 	struct
 	{
 		Vec pos;
@@ -44,16 +67,69 @@ public:
 	
 	void draw();
 	void act(unit dt);
+	
+	void setSolver(LinearSolver *); // Takes ownership
+	void setStaggered(bool); // MAC grid; u and v then follow from the faces
+	bool staggered() const { return uf; }
+	GUI::Rect area() const; // Of the simulation bounds the grid covers
+	bool refined(int i, int j) const; // Whether a patch covers cell (i, j)
 
 private:
-	void add_source(unit *x, unit *s, unit dt);
-	void set_bnd(int b, unit *x);
-	void lin_solve(int b, unit *x, unit *x0, unit a, unit c);
-	void diffuse(int b, unit *x, unit *x0, unit diff, unit dt);
-	void advect(int b, unit *d, unit *d0, unit *u, unit *v, unit dt);
-	void project(unit *u, unit *v, unit *p, unit *div);
-	void dens_step(unit *x, unit *x0, unit *u, unit *v, unit diff, unit dt);
-	void vel_step(unit *u, unit *v, unit *u0, unit *v0, unit visc, unit dt);
+	real *uf0, *vf0;
+	unit sx, sy; // Cells per unit of length, width and height unless a patch
+	std::vector<real> kept[2]; // Pressure of both projections, first guess next step and patch borders
+	int projections; // Made this step
+	size_t cells; // Active
+	struct
+	{
+		int cell;
+		Vec v;
+		unit d;
+	} source; // From the mouse, this step
+	std::vector<char> tiles; // Sparse mode: active tiles, including the halo
+	struct Link
+	{
+		int id, next; // Of the obstacles covering a cell, next -1 at the end
+	};
+	std::vector<Spans> footprints; // Of bodies, as rasterised last step
+	std::vector<Link> links; // Pool of the lists, including the spare ones
+	std::vector<int> covers; // First link of each cell, -1 for none
+	int spare; // First unused link
+	struct Contact
+	{
+		int c, to[4]; // Cell on an obstacle, and the cells its density goes to
+		real share; // Of its density going to each
+		Vec f[4]; // On the quad's corners, or the rigid body's force and torque (x)
+	};
+	std::vector<Contact> contacts; // Cells coupled this step, in order
+	std::vector<size_t> starts; // Of each band of rows in contacts
+	Spans footprint; // Scratch for the obstacle being rasterised
+	std::vector<int> vacated; // Cells left by their owner this step
+	
+	void cover(size_t k, Body body, const Vec *verts);
+	void uncover(size_t k);
+	void settle(size_t count);
+	void link(int c, int id);
+	void unlink(int c, int id);
+	void couple();
+	void mark();
+	void clearTile(int t, real *x);
+	void regrid();
+	void place(int i0, int j0, int i1, int j1, std::vector<Fluid *> &old);
+	void keep(const real *p, unit scale = 1.0);
+	void coarsen(const Fluid *patch);
+	Vec outer(int i, int j) const;
+	unit sample(const real *x, unit i, unit j) const;
+	void set_bnd(int b, real *x);
+	void lin_solve(int b, real *x, real *x0, unit a, unit c);
+	void diffuse(int b, real *x, real *x0, unit diff, unit dt);
+	void advect(int b, real *d, real *d0, real *u, real *v, unit dt);
+	void project(real *u, real *v, real *p, real *div);
+	void dens_step(unit diff, unit dt);
+	void vel_step(unit visc, unit dt);
+	void mac_advect(real *uf, real *vf, real *uf0, real *vf0, unit dt);
+	void mac_project(real *p, real *div);
+	void mac_step(unit visc, unit dt);
 };
 
 //------------------------------------------------------------------------------
@@ -3,10 +3,12 @@
  **************************************************************/
 
 #include <math.h>
+#include <algorithm>
 
 #include "GL/freeglut.h"
 
 #include "forces.h"
+#include "threads.h"
 
 namespace Sim {
 
@@ -110,21 +112,21 @@ void Gravity::draw()
 	Vec arrow = (g2 + g2.rotL()) / 4.0;
 	glBegin(GL_LINES);
 	glColor3f(0.8, 0.7, 0.6);
-	glVertex2dv(origin.data);
+	glVertex2dv(origin.data());
 	glColor3f(0.8, 0.7, 0.6);
-	glVertex2dv(pos.data);
+	glVertex2dv(pos.data());
 	glEnd();
 	glBegin(GL_LINES);
 	glColor3f(0.8, 0.7, 0.6);
-	glVertex2dv(pos.data);
+	glVertex2dv(pos.data());
 	glColor3f(0.8, 0.7, 0.6);
 	glVertex2d(pos.x + arrow.x, pos.y - arrow.y);
 	glEnd();
 	glBegin(GL_LINES);
 	glColor3f(0.8, 0.7, 0.6);
-	glVertex2dv(pos.data);
+	glVertex2dv(pos.data());
 	glColor3f(0.8, 0.7, 0.6);
-	glVertex2dv((pos - arrow).data);
+	glVertex2dv((pos - arrow).data());
 	glEnd();
 }
 
@@ -157,9 +159,9 @@ void Spring::draw()
 	
 	glBegin(GL_LINES);
 	glColor3dv(color);
-	glVertex2dv(p1->x->data);
+	glVertex2dv(p1->x->data());
 	glColor3dv(color);
-	glVertex2dv(p2->x->data);
+	glVertex2dv(p2->x->data());
 	glEnd();
 }
 
@@ -179,6 +181,232 @@ void Spring::apply()
 	*p2->f -= f;
 }
 
+/** Derivatives of the force of a spring along x, times z. The stiffness across
+    the spring is clamped at zero when it is compressed, which keeps the system
+    of an implicit step definite; damping only acts along the spring. */
+static Vec springDerivative(const Vec &x, unit rest, unit ks, unit kd, unit cx,
+	unit cv, const Vec &z)
+{
+	unit l = x.length();
+	Vec d = x / l;
+	unit across = l > rest ? 1.0 - rest / l : 0.0;
+	unit along = d * z;
+	return (cx * ks) * ((across * (z - along * d)) + (along * d))
+		+ (cv * kd * along) * d;
+}
+
+void Spring::differentiate(const ParticleSystem &s, unit cx, unit cv,
+	const Vec *y, Vec *out)
+{
+	Vec x = *p1->x - *p2->x;
+	if (!x)
+		return;
+	
+	const size_t i = p1->x - s.x.data(), j = p2->x - s.x.data();
+	Vec f = springDerivative(x, rest, ks, kd, cx, cv, y[i] - y[j]);
+	out[i] += f;
+	out[j] -= f;
+}
+
+/** One XPBD pass over the distance constraint |x_i - x_j| = rest, compliant
+    and damped like a spring of stiffness ks and damping kd. Returns the change
+    of the multiplier lambda. */
+static unit projectDistance(const Projection &p, size_t i, size_t j, unit rest,
+	unit ks, unit kd, unit lambda)
+{
+	Vec *X = p.s.x.data();
+	const unit w = p.w[i] + p.w[j];
+	Vec x = X[i] - X[j];
+	if (!x || w == 0.0 || ks >= 0.0)
+		return 0.0;
+	
+	unit l = x.length();
+	Vec n = x / l;
+	unit alpha = -1.0 / (ks * p.h * p.h); // Compliance over h^2
+	unit gamma = -alpha * kd * p.h;
+	unit rate = n * ((X[i] - p.x0[i]) - (X[j] - p.x0[j]));
+	unit dl = (rest - l - alpha * lambda - gamma * rate)
+		/ (((1.0 + gamma) * w) + alpha);
+	X[i] += (p.w[i] * dl) * n;
+	X[j] -= (p.w[j] * dl) * n;
+	return dl;
+}
+
+void Spring::project(const Projection &p)
+{
+	if (p.first)
+		lambda = 0.0;
+	const Vec *x = p.s.x.data();
+	lambda += projectDistance(p, p1->x - x, p2->x - x, rest, ks, kd, lambda);
+}
+
+//------------------------------------------------------------------------------
+
+void SpringNetwork::add(ParticleBase *p1, ParticleBase *p2, unit r, unit s,
+	unit d)
+{
+	const Vec *x = sim->getSystem().x.data();
+	a.push_back(p1->x - x);
+	b.push_back(p2->x - x);
+	rest.push_back(r);
+	ks.push_back(s);
+	kd.push_back(d);
+}
+
+//------------------------------------------------------------------------------
+
+void SpringNetwork::draw()
+{
+	const Vec *x = sim->getSystem().x.data();
+	
+	glBegin(GL_LINES);
+	for (size_t k = 0; k < a.size(); ++k)
+	{
+		unit l = fabs((x[a[k]] - x[b[k]]).length() - rest[k]);
+		const double color[3] = {0.6 + l, 0.7, 0.8 - l};
+		glColor3dv(color);
+		glVertex2dv(x[a[k]].data());
+		glColor3dv(color);
+		glVertex2dv(x[b[k]].data());
+	}
+	glEnd();
+}
+
+//------------------------------------------------------------------------------
+
+void SpringNetwork::apply()
+{
+	static const size_t parallel_threshold = 4096;
+	if (parallel && size() >= parallel_threshold && Threads::pool().size() > 1)
+	{
+		applyParallel();
+		return;
+	}
+	
+	ParticleSystem &system = sim->getSystem();
+	const Vec *X = system.x.data(), *V = system.v.data();
+	Vec *F = system.f.data();
+	
+	for (size_t k = 0; k < a.size(); ++k)
+	{
+		const size_t i = a[k], j = b[k];
+		Vec x = X[i] - X[j],
+			v = V[i] - V[j];
+		if (!x)
+			continue;
+		
+		unit l = x.length();
+		Vec f = ((ks[k] * (l - rest[k])) + (kd[k] * (v * x) / l)) * (x / l);
+		
+		F[i] += f;
+		F[j] -= f;
+	}
+}
+
+void SpringNetwork::differentiate(const ParticleSystem &s, unit cx, unit cv,
+	const Vec *y, Vec *out)
+{
+	const Vec *X = s.x.data();
+	for (size_t k = 0; k < size(); ++k)
+	{
+		const size_t i = a[k], j = b[k];
+		Vec x = X[i] - X[j];
+		if (!x)
+			continue;
+		
+		Vec f = springDerivative(x, rest[k], ks[k], kd[k], cx, cv, y[i] - y[j]);
+		out[i] += f;
+		out[j] -= f;
+	}
+}
+
+void SpringNetwork::project(const Projection &p)
+{
+	if (p.first)
+		lambda.assign(size(), 0.0);
+	for (size_t k = 0; k < size(); ++k)
+		lambda[k] += projectDistance(p, a[k], b[k], rest[k], ks[k], kd[k],
+			lambda[k]);
+}
+
+void SpringNetwork::index()
+{
+	std::vector<size_t> degree;
+	for (size_t k = 0; k < size(); ++k)
+	{
+		size_t m = std::max(a[k], b[k]);
+		if (m >= degree.size())
+			degree.resize(m + 1, 0);
+		++degree[a[k]];
+		++degree[b[k]];
+	}
+	
+	nodes.clear();
+	offsets.assign(1, 0);
+	std::vector<size_t> slot(degree.size());
+	for (size_t i = 0; i < degree.size(); ++i)
+	{
+		if (!degree[i])
+			continue;
+		slot[i] = offsets.back();
+		nodes.push_back(i);
+		offsets.push_back(offsets.back() + degree[i]);
+	}
+	
+	// Filling in spring order keeps every particle's list ascending
+	incident.resize(offsets.back());
+	for (size_t k = 0; k < size(); ++k)
+	{
+		incident[slot[a[k]]++] = (long) k + 1;
+		incident[slot[b[k]]++] = -((long) k + 1);
+	}
+	forces.resize(size());
+	indexed = size();
+}
+
+void SpringNetwork::applyParallel()
+{
+	if (indexed != size())
+		index();
+	
+	ParticleSystem &system = sim->getSystem();
+	const Vec *X = system.x.data(), *V = system.v.data();
+	Vec *F = system.f.data();
+	
+	Threads::pool().parallel(size(), [&](size_t begin, size_t end)
+	{
+		for (size_t k = begin; k < end; ++k)
+		{
+			Vec x = X[a[k]] - X[b[k]],
+				v = V[a[k]] - V[b[k]];
+			if (!x)
+			{
+				forces[k] = Vec();
+				continue;
+			}
+			
+			unit l = x.length();
+			forces[k] = ((ks[k] * (l - rest[k])) + (kd[k] * (v * x) / l)) * (x / l);
+		}
+	});
+	
+	Threads::pool().parallel(nodes.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t n = begin; n < end; ++n)
+		{
+			Vec &f = F[nodes[n]];
+			for (size_t e = offsets[n]; e < offsets[n + 1]; ++e)
+			{
+				long k = incident[e];
+				if (k > 0)
+					f += forces[k - 1];
+				else
+					f -= forces[-k - 1];
+			}
+		}
+	});
+}
+
 //------------------------------------------------------------------------------
 
 void AngularSpring::draw()
@@ -187,11 +415,11 @@ void AngularSpring::draw()
 	
 	glBegin(GL_LINES);
 	glColor3dv(color);
-	glVertex2dv(p1->x->data);
+	glVertex2dv(p1->x->data());
 	glColor3dv(color);
-	glVertex2dv(p2->x->data);
+	glVertex2dv(p2->x->data());
 	glColor3dv(color);
-	glVertex2dv(p3->x->data);
+	glVertex2dv(p3->x->data());
 	glEnd();
 }
 
@@ -217,6 +445,32 @@ void AngularSpring::apply()
 	*p3->f += f3;
 }
 
+// The constraint is on the angle itself, with the compliance of the stiffness
+// the force uses per radian; no damping.
+void AngularSpring::project(const Projection &p)
+{
+	if (p.first)
+		lambda = 0.0;
+	Vec *X = p.s.x.data();
+	const size_t i = p1->x - X, j = p2->x - X, k = p3->x - X;
+	Vec v1 = X[i] - X[j],
+		v2 = X[k] - X[j];
+	if (!v1 || !v2 || ks == 0.0)
+		return;
+	
+	Vec g1 = v1.rotL() / (v1 * v1),
+		g3 = -v2.rotL() / (v2 * v2),
+		g2 = -(g1 + g3);
+	unit w = (p.w[i] * (g1 * g1)) + (p.w[j] * (g2 * g2)) + (p.w[k] * (g3 * g3));
+	unit alpha = 1.0 / (fabs(ks) * p.h * p.h);
+	unit c = remainder(v1.angle() - v2.angle() - angle, 2.0 * Pi);
+	unit dl = (-c - alpha * lambda) / (w + alpha);
+	X[i] += (p.w[i] * dl) * g1;
+	X[j] += (p.w[j] * dl) * g2;
+	X[k] += (p.w[k] * dl) * g3;
+	lambda += dl;
+}
+
 //------------------------------------------------------------------------------
 
 void Glue::apply()
@@ -226,6 +480,16 @@ void Glue::apply()
 	*p->f = Vec();
 }
 
+void Glue::constrain(const ParticleSystem &s, Vec *y)
+{
+	y[p->x - s.x.data()] = Vec();
+}
+
+void Glue::project(const Projection &)
+{
+	*p->x = x;
+}
+
 //------------------------------------------------------------------------------
 
 void Borders::apply()
@@ -368,17 +632,81 @@ void collide(Collisions &col, T &a, U &b)
 	setForce(b, f2, x);
 }
 
+template <typename T>
+static void makeBounds(Vec &min, Vec &max, const T &body)
+{
+	Vec P[4];
+	makePolygon(P, body);
+	min = max = P[0];
+	for (int i = 1; i < 4; ++i)
+	{
+		if (P[i].x < min.x) min.x = P[i].x;
+		if (P[i].y < min.y) min.y = P[i].y;
+		if (P[i].x > max.x) max.x = P[i].x;
+		if (P[i].y > max.y) max.y = P[i].y;
+	}
+}
+
+bool Collisions::Order::operator ()(const std::pair<size_t,size_t> &a,
+	const std::pair<size_t,size_t> &b) const
+{
+	int ca = (a.first >= *nquads) + (a.second >= *nquads);
+	int cb = (b.first >= *nquads) + (b.second >= *nquads);
+	if (ca != cb)
+		return ca < cb;
+	return a < b;
+}
+
+void Collisions::added(size_t a, size_t b)
+{
+	pairs.insert(std::make_pair(a, b));
+}
+
+void Collisions::removed(size_t a, size_t b)
+{
+	pairs.erase(std::make_pair(a, b));
+}
+
+void Collisions::cleared()
+{
+	pairs.clear();
+}
+
 void Collisions::apply()
 {
-	for (Quad **q1 = sim->getQuads(); *q1; ++q1)
-		for (Quad **q2 = q1 + 1; *q2; ++q2)
-			collide(*this, **q1, **q2);
-	for (Quad **q = sim->getQuads(); *q; ++q)
-		for (RigidBase **r = sim->getRigids(); *r; ++r)
-			collide(*this, **q, **r);
-	for (RigidBase **r1 = sim->getRigids(); *r1; ++r1)
-		for (RigidBase **r2 = r1 + 1; *r2; ++r2)
-			collide(*this, **r1, **r2);
+	Quad **quads = sim->getQuads();
+	RigidBase **rigids = sim->getRigids();
+	
+	bounds.clear();
+	for (Quad **q = quads; *q; ++q)
+	{
+		bounds.push_back(Bounds());
+		makeBounds(bounds.back().min, bounds.back().max, **q);
+	}
+	if (bounds.size() != nquads)
+	{
+		// Renumbered; also invalidates the pair order
+		broad.clear();
+		pairs.clear();
+		nquads = bounds.size();
+	}
+	for (RigidBase **r = rigids; *r; ++r)
+	{
+		bounds.push_back(Bounds());
+		makeBounds(bounds.back().min, bounds.back().max, **r);
+	}
+	broad.update(bounds);
+	
+	const size_t nq = nquads;
+	for (auto &p : pairs)
+	{
+		if (p.second < nq)
+			collide(*this, *quads[p.first], *quads[p.second]);
+		else if (p.first < nq)
+			collide(*this, *quads[p.first], *rigids[p.second - nq]);
+		else
+			collide(*this, *rigids[p.first - nq], *rigids[p.second - nq]);
+	}
 }
 
 //------------------------------------------------------------------------------
@@ -13,8 +13,11 @@
 #ifndef _FORCES_H
 #define _FORCES_H
 
+#include <set>
+
 #include "core.h"
 #include "sim.h"
+#include "broadphase.h"
 
 namespace Sim {
 
@@ -47,7 +50,8 @@ public:
 
 //------------------------------------------------------------------------------
 
-class Spring : public Force, public virtual Drawable
+class Spring : public Force, public virtual Drawable,
+	public virtual Differentiable, public virtual Projectable
 {
 public:
 	ParticleBase *p1, *p2;
@@ -55,15 +59,63 @@ public:
 	unit ks, kd;
 	
 	Spring(ParticleBase *_p1, ParticleBase *_p2, unit _rest, const unit &_ks,
-		const unit &_kd) : p1(_p1), p2(_p2), rest(_rest), ks(_ks), kd(_kd) {}
+		const unit &_kd)
+		: p1(_p1), p2(_p2), rest(_rest), ks(_ks), kd(_kd), lambda(0.0) {}
+	
+	virtual void draw();
+	virtual void apply();
+	virtual void differentiate(const ParticleSystem &, unit cx, unit cv,
+		const Vec *y, Vec *out);
+	virtual void project(const Projection &);
+
+private:
+	unit lambda; // Multiplier of the substep
+};
+
+//------------------------------------------------------------------------------
+
+/** A batch of springs, stored as flat arrays of particle system indices and
+    parameters, evaluated in one pass. Use this for large meshes. */
+class SpringNetwork : public Force, public virtual Drawable,
+	public virtual Differentiable, public virtual Projectable
+{
+public:
+	Simulation *sim;
+	std::vector<size_t> a, b; // Particle indices
+	units rest, ks, kd;
+	bool parallel; // Use the thread pool for large networks
+	
+	SpringNetwork(Simulation *_sim, bool _parallel = true)
+		: sim(_sim), parallel(_parallel), indexed(0) {}
+	
+	void add(ParticleBase *p1, ParticleBase *p2, unit rest, unit ks, unit kd);
+	size_t size() const { return a.size(); }
 	
 	virtual void draw();
 	virtual void apply();
+	virtual void differentiate(const ParticleSystem &, unit cx, unit cv,
+		const Vec *y, Vec *out);
+	virtual void project(const Projection &);
+
+private:
+	units lambda; // Multipliers of the substep
+	
+	// Parallel pass: spring forces are computed into a buffer, then every
+	// particle gathers its springs in index order, so the sums are identical
+	// to the serial pass.
+	Vecs forces;
+	std::vector<size_t> nodes, offsets; // Particles and their incidence ranges
+	std::vector<long> incident; // Spring k + 1 if the particle is a, -(k + 1) if b
+	size_t indexed;
+	
+	void index();
+	void applyParallel();
 };
 
 //------------------------------------------------------------------------------
 
-class AngularSpring : public Force, public virtual Drawable
+class AngularSpring : public Force, public virtual Drawable,
+	public virtual Projectable
 {
 public:
 	ParticleBase *p1, *p2, *p3;
@@ -72,18 +124,21 @@ public:
 	
 	AngularSpring(ParticleBase *_p1, ParticleBase *_p2, ParticleBase *_p3,
 		unit _angle, const unit &_ks)
-		: p1(_p1), p2(_p2), p3(_p3), angle(_angle), ks(_ks), old(Pi / 2) {}
+		: p1(_p1), p2(_p2), p3(_p3), angle(_angle), ks(_ks), old(Pi / 2),
+		lambda(0.0) {}
 	
 	virtual void draw();
 	virtual void apply();
+	virtual void project(const Projection &);
 
 private:
 	unit old;
+	unit lambda; // Multiplier of the substep
 };
 
 //------------------------------------------------------------------------------
 
-class Glue : public Force
+class Glue : public Force, public virtual Constraint, public virtual Projectable
 {
 public:
 	ParticleBase *p;
@@ -92,6 +147,8 @@ public:
 	Glue(ParticleBase *_p, Vec _x) : p(_p), x(_x) {}
 	
 	virtual void apply();
+	virtual void constrain(const ParticleSystem &, Vec *y);
+	virtual void project(const Projection &);
 };
 
 //------------------------------------------------------------------------------
@@ -109,14 +166,35 @@ public:
 
 //------------------------------------------------------------------------------
 
-class Collisions : public Force
+class Collisions : public Force, private SweepAndPrune::Listener
 {
 public:
 	Simulation *sim;
 	
-	Collisions(Simulation *_sim) : sim(_sim) {}
+	Collisions(Simulation *_sim)
+		: sim(_sim), broad(this), nquads(0), pairs(Order(&nquads)) {}
 	
 	virtual void apply();
+
+private:
+	// Broad phase: bodies are numbered quads first, then rigids. Overlapping
+	// pairs are kept in the order of an exhaustive test: quad pairs, quad-rigid
+	// pairs, rigid pairs, each ascending.
+	struct Order
+	{
+		const size_t *nquads;
+		Order(const size_t *n) : nquads(n) {}
+		bool operator ()(const std::pair<size_t,size_t> &,
+			const std::pair<size_t,size_t> &) const;
+	};
+	SweepAndPrune broad;
+	std::vector<Bounds> bounds;
+	size_t nquads;
+	std::set<std::pair<size_t,size_t>, Order> pairs;
+	
+	void added(size_t a, size_t b);
+	void removed(size_t a, size_t b);
+	void cleared();
 };
 
 //------------------------------------------------------------------------------
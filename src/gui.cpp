@@ -16,6 +16,7 @@ const int default_width = 800;
 const int default_height = 600;
 
 std::map<int,Window *> windows;
+bool initialised = false; // Windows created before Init() are headless
 
 //------------------------------------------------------------------------------
 
@@ -126,6 +127,12 @@ Window::Window(const char *title)
 	cache({0, 0, default_width, default_height,
 		(float) default_width / (float) default_height})
 {
+	if (!initialised)
+	{
+		id = 0;
+		return;
+	}
+	
 	int default_x = (glutGet(GLUT_SCREEN_WIDTH) - default_width) / 2;
 	int default_y = (glutGet(GLUT_SCREEN_HEIGHT) - default_height) / 2;
 	
@@ -160,6 +167,7 @@ Window::Window(const char *title)
 
 Window::~Window()
 {
+	if (!id) return;
 	glutDestroyWindow(id);
 	windows.erase(id);
 }
@@ -252,6 +260,7 @@ void Window::postdraw()
 void Init(int *argc, char *argv[])
 {
 	glutInit(argc, argv);
+	initialised = true;
 }
 
 //------------------------------------------------------------------------------
@@ -2,12 +2,12 @@
  * Integration functionality -- See header file for more information. *
  **********************************************************************/
 
+#include <algorithm>
+
 #include "integrators.h"
 
 namespace Sim {
 
-//------------------------------------------------------------------------------
-
 void Euler::integrate(unit h)
 {
 	for (size_t i = 0; i < system.size; ++i)
@@ -48,55 +48,265 @@ void Verlet::integrate(unit h)
 
 //------------------------------------------------------------------------------
 
+static unit dot(const Vecs &x, const Vecs &y, size_t n)
+{
+	unit s = 0.0;
+	for (size_t i = 0; i < n; ++i)
+		s += x[i] * y[i];
+	return s;
+}
+
+void ImplicitEuler::integrate(unit h)
+{
+	const size_t n = system.size;
+	dv.resize(n);
+	r.resize(n);
+	d.resize(n);
+	q.resize(n);
+	
+	// b = h (f + h df/dx v), r = b - A dv
+	for (size_t i = 0; i < n; ++i)
+		r[i] = h * system.f[i];
+	differentiate(h * h, 0.0, system.v.data(), r.data());
+	constrain(r.data());
+	constrain(dv.data());
+	const unit bb = dot(r, r, n);
+	multiply(h, dv, q);
+	for (size_t i = 0; i < n; ++i)
+		d[i] = r[i] -= q[i];
+	
+	unit rr = dot(r, r, n);
+	int k = 0;
+	for (; k < iterations && rr > tolerance * tolerance * bb; ++k)
+	{
+		multiply(h, d, q);
+		unit alpha = rr / dot(d, q, n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			dv[i] += alpha * d[i];
+			r[i] -= alpha * q[i];
+		}
+		unit old = rr;
+		rr = dot(r, r, n);
+		for (size_t i = 0; i < n; ++i)
+			d[i] = r[i] + (rr / old) * d[i];
+	}
+	stats.iterations = k;
+	stats.residual = bb > 0.0 ? sqrt(rr / bb) : 0.0;
+	
+	for (size_t i = 0; i < n; ++i)
+	{
+		system.v[i] += dv[i];
+		system.x[i] += h * system.v[i];
+	}
+	for (size_t i = 0; i < system2.size; ++i)
+	{
+		system2.v[i] += h * system2.f[i] / system2.m[i];
+		system2.x[i] += h * system2.v[i];
+		system2.w[i] += h * system2.t[i] / (system2.i[i] * system2.m[i]);
+		system2.o[i] += h * system2.w[i];
+	}
+}
+
+/** out = (M - h df/dv - h^2 df/dx) y, constrained */
+void ImplicitEuler::multiply(unit h, const Vecs &y, Vecs &out)
+{
+	for (size_t i = 0; i < system.size; ++i)
+		out[i] = system.m[i] * y[i];
+	differentiate(-h * h, -h, y.data(), out.data());
+	constrain(out.data());
+}
+
+//------------------------------------------------------------------------------
+
+void PositionBased::integrate(unit h)
+{
+	const size_t n = system.size;
+	const unit s = h / substeps;
+	x0.resize(n);
+	w.resize(n);
+	held.assign(n, Vec(1.0, 1.0));
+	constrain(held.data());
+	for (size_t i = 0; i < n; ++i)
+		w[i] = held[i].x / system.m[i];
+	
+	for (int k = 0; k < substeps; ++k)
+	{
+		if (k)
+			calcForces(false);
+		for (size_t i = 0; i < n; ++i)
+		{
+			x0[i] = system.x[i];
+			if (w[i] == 0.0)
+				continue;
+			system.v[i] += s * w[i] * system.f[i];
+			system.x[i] += s * system.v[i];
+		}
+		
+		Projection p = {system, x0.data(), w.data(), s, true};
+		for (int it = 0; it < iterations; ++it, p.first = false)
+			project(p);
+		
+		for (size_t i = 0; i < n; ++i)
+			system.v[i] = (system.x[i] - x0[i]) / s;
+		for (size_t i = 0; i < system2.size; ++i)
+		{
+			system2.v[i] += s * system2.f[i] / system2.m[i];
+			system2.x[i] += s * system2.v[i];
+			system2.w[i] += s * system2.t[i] / (system2.i[i] * system2.m[i]);
+			system2.o[i] += s * system2.w[i];
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+
 void MidPointBase::integrate(unit h)
 {
 	saveState();
 	subint->integrate(h / 2.0);
-	calcForces();
+	calcForces(!projects());
 	restoreState();
 	subint->integrate(h);
 }
 
 //------------------------------------------------------------------------------
 
+// The stage forces are summed into k, u and q as they come in, in the same
+// order as k1/6 + k2/3 + k3/3 + k4/6, so no per-stage copies are needed.
+// Every probe starts from the same state, so it is saved only once.
+
 void RungeKutta4Base::integrate(unit h)
 {
-	Vecs k1 = system.f;
-	Vecs u1 = system2.f;
-	auto v1 = system2.t;
+	k.resize(system.size);
+	u.resize(system2.size);
+	q.resize(system2.size);
+	for (size_t i = 0; i < system.size; ++i)
+		k[i] = system.f[i] / 6;
+	for (size_t i = 0; i < system2.size; ++i)
+	{
+		u[i] = system2.f[i] / 6;
+		q[i] = system2.t[i] / 6;
+	}
 	
 	saveState();
-	subint->integrate(h / 2.0);
-	calcForces();
-	restoreState();
-	Vecs k2 = system.f;
-	Vecs u2 = system2.f;
-	auto v2 = system2.t;
+	probe(h / 2.0);
+	accumulate(3);
+	probe(h / 2.0);
+	accumulate(3);
+	probe(h);
 	
-	saveState();
-	subint->integrate(h / 2.0);
-	calcForces();
-	restoreState();
-	Vecs k3 = system.f;
-	Vecs u3 = system2.f;
-	auto v3 = system2.t;
+	for (size_t i = 0; i < system.size; ++i)
+		system.f[i] = k[i] + system.f[i] / 6;
+	for (size_t i = 0; i < system2.size; ++i)
+	{
+		system2.f[i] = u[i] + system2.f[i] / 6;
+		system2.t[i] = q[i] + system2.t[i] / 6;
+	}
 	
-	saveState();
 	subint->integrate(h);
-	calcForces();
+}
+
+void RungeKutta4Base::probe(unit h)
+{
+	subint->integrate(h);
+	calcForces(!projects());
 	restoreState();
-	Vecs k4 = system.f;
-	Vecs u4 = system2.f;
-	auto v4 = system2.t;
-	
+}
+
+void RungeKutta4Base::accumulate(unit d)
+{
 	for (size_t i = 0; i < system.size; ++i)
+		k[i] += system.f[i] / d;
+	for (size_t i = 0; i < system2.size; ++i)
 	{
-		system.f[i] = k1[i]/6 + k2[i]/3 + k3[i]/3 + k4[i]/6;
-		system2.f[i] = u1[i]/6 + u2[i]/3 + u3[i]/3 + u4[i]/6;
-		system2.t[i] = v1[i]/6 + v2[i]/3 + v3[i]/3 + v4[i]/6;
+		u[i] += system2.f[i] / d;
+		q[i] += system2.t[i] / d;
 	}
-	
-	subint->integrate(h);
+}
+
+//------------------------------------------------------------------------------
+
+void AdaptiveBase::integrate(unit h)
+{
+	while (h > 0.0)
+	{
+		const unit s = step < h ? step : h;
+		save();
+		subint->integrate(s);
+		whole.x = system.x;
+		whole2.x = system2.x;
+		whole2.o = system2.o;
+		
+		restore();
+		subint->integrate(s / 2.0);
+		calcForces(!projects());
+		subint->integrate(s / 2.0);
+		
+		// Local error of a first order step, which is the pessimistic guess
+		const unit e = error();
+		unit scale = e > 0.0 ? 0.9 * sqrt(tolerance / e) : 2.0;
+		scale = scale < 0.2 ? 0.2 : scale > 2.0 ? 2.0 : scale;
+		if (e <= tolerance || s <= minimum)
+		{
+			++accepted;
+			h -= s;
+			if (h > 0.0)
+				calcForces(!projects());
+		}
+		else
+		{
+			++rejected;
+			restore();
+		}
+		
+		// A step cut short by h says nothing about larger ones
+		if (s == step || scale < 1.0)
+			step = s * scale;
+		step = step < minimum ? minimum : step > maximum ? maximum : step;
+	}
+}
+
+void AdaptiveBase::save()
+{
+	start.x = system.x;
+	start.v = system.v;
+	start.f = system.f;
+	start2.x = system2.x;
+	start2.v = system2.v;
+	start2.f = system2.f;
+	start2.o = system2.o;
+	start2.w = system2.w;
+	start2.t = system2.t;
+}
+
+// Copied in place, so the particles' pointers stay valid
+void AdaptiveBase::restore()
+{
+	std::copy(start.x.begin(), start.x.end(), system.x.begin());
+	std::copy(start.v.begin(), start.v.end(), system.v.begin());
+	std::copy(start.f.begin(), start.f.end(), system.f.begin());
+	std::copy(start2.x.begin(), start2.x.end(), system2.x.begin());
+	std::copy(start2.v.begin(), start2.v.end(), system2.v.begin());
+	std::copy(start2.f.begin(), start2.f.end(), system2.f.begin());
+	std::copy(start2.o.begin(), start2.o.end(), system2.o.begin());
+	std::copy(start2.w.begin(), start2.w.end(), system2.w.begin());
+	std::copy(start2.t.begin(), start2.t.end(), system2.t.begin());
+}
+
+// Largest difference to the whole step, infinite once anything blew up
+unit AdaptiveBase::error() const
+{
+	unit e = 0.0;
+	auto grow = [&](unit d) { if (!(d <= e)) e = d == d ? d : 1.0 / 0.0; };
+	for (size_t i = 0; i < system.size; ++i)
+		grow((system.x[i] - whole.x[i]).length());
+	for (size_t i = 0; i < system2.size; ++i)
+	{
+		grow((system2.x[i] - whole2.x[i]).length());
+		grow(fabs(system2.o[i] - whole2.o[i]));
+	}
+	return e;
 }
 
 //------------------------------------------------------------------------------
@@ -30,6 +30,8 @@ public:
 		: sim(_sim), system(_sim.getSystem()), system2(_sim.getSystem2()) {}
 	virtual ~Integrator() {}
 	virtual void integrate(unit h) = 0;
+	/** Whether Projectable forces are solved here rather than applied */
+	virtual bool projects() const { return false; }
 
 protected:
 	Simulation &sim;
@@ -38,7 +40,11 @@ protected:
 	
 	void saveState() { sim.saveState(); }
 	void restoreState() { sim.restoreState(); }
-	void calcForces() { sim.calcForces(); }
+	void calcForces(bool projectables = true) { sim.calcForces(projectables); }
+	void differentiate(unit cx, unit cv, const Vec *y, Vec *out)
+		{ sim.differentiate(cx, cv, y, out); }
+	void constrain(Vec *y) { sim.constrain(y); }
+	void project(const Projection &p) { sim.project(p); }
 };
 
 //------------------------------------------------------------------------------
@@ -61,12 +67,65 @@ public:
 
 //------------------------------------------------------------------------------
 
+/** Linearised backward Euler for the particles, after Baraff and Witkin: solves
+    (M - h df/dv - h^2 df/dx) dv = h (f + h df/dx v) with matrix free conjugate
+    gradients over the Differentiable forces, starting from the last step's dv.
+    Constrained particles are kept out of the solve. Rigid bodies take an
+    explicit Euler step. */
+class ImplicitEuler : public Integrator
+{
+public:
+	struct Stats
+	{
+		int iterations;
+		unit residual; // Relative: |b - A dv| / |b|
+	};
+	
+	int iterations; // Maximum
+	unit tolerance; // Relative residual to stop at
+	Stats stats; // Of the last step
+	
+	ImplicitEuler(Simulation &sim, unit tol = 1e-4, int it = 100)
+		: Integrator(sim), iterations(it), tolerance(tol), stats({0, 0.0}) {}
+	void integrate(unit h);
+
+private:
+	Vecs dv, r, d, q; // Solution, residual, search direction, A d
+	
+	void multiply(unit h, const Vecs &y, Vecs &out);
+};
+
+//------------------------------------------------------------------------------
+
+/** Extended position based dynamics (XPBD) for the particles. Every substep
+    predicts the positions from the other forces, runs Gauss-Seidel passes
+    over the Projectable forces as constraints, and takes the velocities from
+    the change in position. Rigid bodies take an explicit Euler substep. */
+class PositionBased : public Integrator
+{
+public:
+	int substeps; // Per step
+	int iterations; // Constraint passes per substep
+	
+	PositionBased(Simulation &sim, int sub = 2, int it = 4)
+		: Integrator(sim), substeps(sub), iterations(it) {}
+	void integrate(unit h);
+	bool projects() const { return true; }
+
+private:
+	Vecs x0, held; // Start of the substep, 0 for held particles
+	units w; // Inverse masses
+};
+
+//------------------------------------------------------------------------------
+
 class MidPointBase : public Integrator
 {
 public:
 	MidPointBase(Simulation &sim, Integrator *i) : Integrator(sim), subint(i) {}
 	virtual ~MidPointBase() {}
 	void integrate(unit h);
+	bool projects() const { return subint->projects(); }
 protected:
 	Integrator *subint;
 };
@@ -86,8 +145,15 @@ public:
 	RungeKutta4Base(Simulation &sim, Integrator *i) : Integrator(sim), subint(i) {}
 	virtual ~RungeKutta4Base() {}
 	void integrate(unit h);
+	bool projects() const { return subint->projects(); }
 protected:
 	Integrator *subint;
+private:
+	Vecs k, u; // Weighted force sums, kept between steps
+	units q;   // Weighted torque sum
+	
+	void probe(unit h);
+	void accumulate(unit d);
 };
 
 template <class I> class RungeKutta4 : public RungeKutta4Base
@@ -99,6 +165,48 @@ public:
 
 //------------------------------------------------------------------------------
 
+/** Adaptive step size by step doubling: every step is taken once whole and
+    once as two halves, and the largest difference in position (or rigid
+    orientation) is the error estimate. Steps within tolerance are accepted
+    with the two halves, others are retried smaller. integrate(h) covers h in
+    as many steps as it takes; step is the size the controller would take next,
+    so callers that let it choose their h advance through quiet periods in a
+    few large steps. */
+class AdaptiveBase : public Integrator
+{
+public:
+	unit tolerance; // Largest error per step
+	unit minimum, maximum; // Bounds of the step size
+	unit step; // Next step size
+	size_t accepted, rejected; // Step counts
+	
+	AdaptiveBase(Simulation &sim, Integrator *i, unit tol, unit min, unit max)
+		: Integrator(sim), tolerance(tol), minimum(min), maximum(max),
+		step(min), accepted(0), rejected(0), subint(i) {}
+	virtual ~AdaptiveBase() {}
+	void integrate(unit h);
+	bool projects() const { return subint->projects(); }
+protected:
+	Integrator *subint;
+private:
+	ParticleSystem start, whole; // State at the start, positions after one step
+	RigidSystem start2, whole2;
+	
+	void save();
+	void restore();
+	unit error() const;
+};
+
+template <class I> class Adaptive : public AdaptiveBase
+{
+public:
+	Adaptive(Simulation &sim, unit tol = 1e-4, unit min = 1e-4, unit max = 0.01)
+		: AdaptiveBase(sim, new I(sim), tol, min, max) {}
+	~Adaptive() { delete subint; }
+};
+
+//------------------------------------------------------------------------------
+
 } /* namespace Sim */
 
 #endif /* _INTEGRATORS_H */
@@ -9,7 +9,10 @@
  *******************************************************/
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <map>
+#include <vector>
 
 #include "GL/freeglut.h"
 
@@ -29,10 +32,18 @@ class Main : public Simulation
 {
 public:
 	Integrator *integrator = NULL;
+	AdaptiveBase *adaptive = NULL; // Chooses dt itself when adapting
+	Integrator *xpbd = NULL; // Solves springs and glue as constraints
 	unit dt = 0.001;
+	bool adapting = false;
+	bool projecting = false;
 	bool HD = false;
 	bool skin = true;
 	unit gravity = 1.0;
+	int solver = 0; // Fluid solver, see useSolver()
+	bool staggered = false; // MAC grid fluid velocities
+	bool sparse = false; // Skip empty fluid tiles
+	bool nested = false; // Refine the fluid around obstacles and vortices
 	
 	Fluid *fluid = NULL;
 	Texture *t1 = NULL;
@@ -44,6 +55,7 @@ public:
 	
 	Main(const char *title);
 	void reset();
+	void useSolver();
 	void preact();
 	void postact();
 	
@@ -59,7 +71,11 @@ public:
 	static void Frame()
 	{
 		instance->preact();
-		if (instance->integrator)
+		if (instance->adapting && instance->adaptive)
+			instance->act(*(instance->adaptive), instance->adaptive->step);
+		else if (instance->projecting && instance->xpbd)
+			instance->act(*(instance->xpbd), instance->dt);
+		else if (instance->integrator)
 			instance->act(*(instance->integrator), instance->dt);
 		instance->postact();
 	}
@@ -90,6 +106,10 @@ public:
 	
 	virtual void draw();
 	virtual void apply();
+	virtual void differentiate(const ParticleSystem &, unit cx, unit cv,
+		const Vec *y, Vec *out);
+	virtual void project(const Projection &);
+	virtual bool projected() const;
 };
 
 Main *Main::instance = NULL;
@@ -101,10 +121,16 @@ void createBox(Simulation *sim, unit x, unit y, unit w, unit h, Texture *tex = N
 
 void createRibbon(Simulation *sim, unit x1, unit y1, unit x2, unit y2, unit w, int r);
 
+int accuracy(bool record, const char *file);
+
 //------------------------------------------------------------------------------
 
 int main(int argc, char *argv[])
 {
+	// Headless, before the GUI is initialised
+	if (argc == 3 && (!strcmp(argv[1], "-record") || !strcmp(argv[1], "-compare")))
+		return accuracy(argv[1][1] == 'r', argv[2]);
+	
 	GUI::Init(&argc, argv);
 	{
 		puts(
@@ -116,9 +142,15 @@ int main(int argc, char *argv[])
 			"Keys:\n"
 			"\t1-5\tSwitch between scenes\n"
 			"\tV\tToggle velocity visualisation mode\n"
+			"\tS\tSwitch fluid solver\n"
+			"\tM\tToggle staggered (MAC) fluid velocities\n"
+			"\tB\tToggle sparse fluid, skipping empty blocks\n"
+			"\tN\tToggle nested fluid, refined around obstacles\n"
 			"\tH\tToggle high-density mode\n"
 			"\t\t(increases particles and fluid cells, but is slow)\n"
 			"\tG\tToggle gravity\n"
+			"\tA\tToggle adaptive time steps\n"
+			"\tX\tToggle position based springs (XPBD)\n"
 			"\tT\tEnable/disable textures\n"
 			"\tR/F5\tReset scene\n"
 			"\tQ/Esc\tQuit the program\n"
@@ -134,8 +166,12 @@ int main(int argc, char *argv[])
 		Euler euler(sim);
 		MidPoint<Verlet> midpoint(sim);
 		RungeKutta4< RungeKutta4<Verlet> > superrunge(sim);
+		Adaptive<Verlet> adaptive(sim);
+		PositionBased xpbd(sim);
 		
 		sim.integrator = &verlet;
+		sim.adaptive = &adaptive;
+		sim.xpbd = &xpbd;
 		
 		Texture texture1("cloth.raw", 477, 477);
 		sim.t1 = &texture1;
@@ -220,6 +256,108 @@ template <> void Main::gotoScene<5>()
 	create<Gravity>(this, G, 0.0);
 }
 
+//------------------------------------------------------------------------------
+// Accuracy harness: runs scenes 1 to 5 headless with fluid stirred in, then
+// records the final state to a file or compares it with such a recording.
+// For the precision of the fluid grids (see FLUID_FLOAT in solvers.h):
+//   make && ./Project2 -record double.dat
+//   make clean && make DEFS=-DFLUID_FLOAT && ./Project2 -compare double.dat
+
+namespace {
+
+const int Steps = 500;
+const char *Parts[] = {"density", "particles", "rigids"};
+
+/** Fluid density, particle positions and rigid body positions */
+std::vector<units> snapshot(Main &sim)
+{
+	std::vector<units> parts(3);
+	const size_t size = (sim.fluid->width + 2) * (sim.fluid->height + 2);
+	parts[0].assign(sim.fluid->d, sim.fluid->d + size);
+	for (ParticleBase **p = sim.getParticles(); *p; ++p)
+	{
+		parts[1].push_back((*p)->x->x);
+		parts[1].push_back((*p)->x->y);
+	}
+	for (RigidBase **r = sim.getRigids(); *r; ++r)
+	{
+		parts[2].push_back((*r)->x->x);
+		parts[2].push_back((*r)->x->y);
+		parts[2].push_back(*(*r)->o);
+	}
+	return parts;
+}
+
+} /* namespace */
+
+int accuracy(bool record, const char *file)
+{
+	FILE *f = fopen(file, record ? "wb" : "rb");
+	if (!f)
+	{
+		perror(file);
+		return EXIT_FAILURE;
+	}
+	
+	Main sim("accuracy");
+	Verlet verlet(sim);
+	printf("%d steps per scene, fluid grids of %d bytes per cell\n", Steps,
+		(int) sizeof(real));
+	for (int scene = 1; scene <= 5; ++scene)
+	{
+		sim.keypress('0' + scene);
+		for (int k = 0; k < Steps; ++k)
+		{
+			sim.fluid->mouse.pos = Vec(0.5, 0.75);
+			sim.fluid->mouse.v = Vec(1000.0, -500.0);
+			sim.fluid->mouse.d = 100.0;
+			sim.act(verlet, sim.dt);
+		}
+		
+		std::vector<units> parts = snapshot(sim);
+		printf("Scene %d:", scene);
+		for (size_t k = 0; k < parts.size(); ++k)
+		{
+			units &a = parts[k];
+			size_t n = a.size();
+			if (record)
+			{
+				fwrite(&n, sizeof(n), 1, f);
+				fwrite(a.data(), sizeof(unit), n, f);
+				continue;
+			}
+			
+			units b;
+			if (fread(&n, sizeof(n), 1, f) == 1 && n == a.size())
+			{
+				b.resize(n);
+				n = fread(b.data(), sizeof(unit), n, f);
+			}
+			if (b.size() != a.size() || n != a.size())
+			{
+				fprintf(stderr, "\n%s: does not match scene %d\n", file, scene);
+				fclose(f);
+				return EXIT_FAILURE;
+			}
+			
+			// Relative L2 and largest absolute difference
+			unit diff = 0.0, norm = 0.0, peak = 0.0;
+			for (size_t i = 0; i < n; ++i)
+			{
+				unit e = fabs(a[i] - b[i]);
+				diff += e * e;
+				norm += b[i] * b[i];
+				peak = e > peak ? e : peak;
+			}
+			printf("%s %s %.1e (max %.1e)", k ? "," : "", Parts[k],
+				norm > 0.0 ? sqrt(diff / norm) : sqrt(diff), peak);
+		}
+		printf(record ? " recorded\n" : "\n");
+	}
+	fclose(f);
+	return EXIT_SUCCESS;
+}
+
 //------------------------------------------------------------------------------
 
 void createCloth(Simulation *sim, unit x, unit y, unit w, unit h, int rx, int ry,
@@ -234,13 +372,15 @@ void createCloth(Simulation *sim, unit x, unit y, unit w, unit h, int rx, int ry
 		for (int j = 0; j < ry; ++j)
 			grid[i][j] = sim->addParticle(Vec(x + (i * dx), y + (j * dy)));
 	
+	SpringNetwork *springs = sim->create<SpringNetwork>(sim);
+	
 	for (int i = 0; i < rx-1; ++i)
 		for (int j = 0; j < ry; ++j)
-			sim->create<Spring>(grid[i][j], grid[i+1][j], dx, ks, kd);
+			springs->add(grid[i][j], grid[i+1][j], dx, ks, kd);
 	
 	for (int j = 0; j < ry-1; ++j)
 		for (int i = 0; i < rx; ++i)
-			sim->create<Spring>(grid[i][j], grid[i][j+1], dy, ks, kd);
+			springs->add(grid[i][j], grid[i][j+1], dy, ks, kd);
 	
 	dx = 1.0 / (unit) (rx-1);
 	dy = 1.0 / (unit) (ry-1);
@@ -277,12 +417,13 @@ void createBox(Simulation *sim, unit x, unit y, unit w, unit h, Texture *tex)
 	unit ks = -1000;
 	unit kd = -300;
 	
-	sim->create<Spring>(p1, p2, w, ks, kd);
-	sim->create<Spring>(p2, p3, h, ks, kd);
-	sim->create<Spring>(p3, p4, w, ks, kd);
-	sim->create<Spring>(p4, p1, h, ks, kd);
-	sim->create<Spring>(p1, p3, d, ks, kd);
-	sim->create<Spring>(p2, p4, d, ks, kd);
+	SpringNetwork *springs = sim->create<SpringNetwork>(sim);
+	springs->add(p1, p2, w, ks, kd);
+	springs->add(p2, p3, h, ks, kd);
+	springs->add(p3, p4, w, ks, kd);
+	springs->add(p4, p1, h, ks, kd);
+	springs->add(p1, p3, d, ks, kd);
+	springs->add(p2, p4, d, ks, kd);
 	if (!tex)
 		sim->create<Quad>(p1, p2, p3, p4);
 	else
@@ -314,17 +455,19 @@ void createRibbon(Simulation *sim, unit x1, unit y1, unit x2, unit y2, unit w, i
 		k += d;
 	}
 	
+	SpringNetwork *springs = sim->create<SpringNetwork>(sim);
+	
 	for (int i = 0; i < r-1; ++i)
 		for (int j = 0; j < 2; ++j)
-			sim->create<Spring>(grid[i][j], grid[i+1][j], l, ks, kd);
+			springs->add(grid[i][j], grid[i+1][j], l, ks, kd);
 	
 	for (int i = 0; i < r; ++i)
-		sim->create<Spring>(grid[i][0], grid[i][1], w, ks, kd);
+		springs->add(grid[i][0], grid[i][1], w, ks, kd);
 	
 	for (int i = 0; i < r-1; ++i)
 	{
-		sim->create<Spring>(grid[i][0], grid[i+1][1], dl, ks, kd);
-		sim->create<Spring>(grid[i][1], grid[i+1][0], dl, ks, kd);
+		springs->add(grid[i][0], grid[i+1][1], dl, ks, kd);
+		springs->add(grid[i][1], grid[i+1][0], dl, ks, kd);
 	}
 	
 	for (int i = 0; i < r-1; ++i)
@@ -365,6 +508,38 @@ void Main::reset()
 	clear();
 	selector = create<MouseSpring>(this);
 	gotoScene<0>();
+	useSolver();
+	if (fluid)
+	{
+		fluid->setStaggered(staggered);
+		fluid->sparse = sparse;
+		fluid->refine = nested ? 2 : 0;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+void Main::useSolver()
+{
+	if (!fluid)
+		return;
+	switch (solver)
+	{
+		case 1:
+			fluid->setSolver(new MultigridSolver(fluid->width, fluid->height));
+			break;
+		case 2:
+			fluid->setSolver(new ConjugateGradientSolver(fluid->width, fluid->height));
+			break;
+		case 3:
+			fluid->setSolver(new RedBlackSolver(fluid->width, fluid->height));
+			break;
+		default:
+			solver = 0;
+			fluid->setSolver(new GaussSeidelSolver(fluid->width, fluid->height));
+			break;
+	}
+	std::cout << "Fluid solver: " << fluid->solver->name() << std::endl;
 }
 
 //------------------------------------------------------------------------------
@@ -439,6 +614,43 @@ void Main::keypress(unsigned char key)
 		case 'V':
 			Fluid::VelocityMode = !Fluid::VelocityMode;
 			break;
+		
+		case 'S':
+			++solver;
+			useSolver();
+			break;
+		
+		case 'M':
+			staggered = !staggered;
+			if (fluid)
+				fluid->setStaggered(staggered);
+			std::cout << "Staggered fluid: " << (staggered ? "on" : "off") << std::endl;
+			break;
+		
+		case 'B':
+			sparse = !sparse;
+			if (fluid)
+				fluid->sparse = sparse;
+			std::cout << "Sparse fluid: " << (sparse ? "on" : "off") << std::endl;
+			break;
+		
+		case 'N':
+			nested = !nested;
+			if (fluid)
+				fluid->refine = nested ? 2 : 0;
+			std::cout << "Nested fluid: " << (nested ? "on" : "off") << std::endl;
+			break;
+		
+		case 'A':
+			adapting = !adapting;
+			std::cout << "Adaptive time steps: " << (adapting ? "on" : "off") << std::endl;
+			break;
+		
+		case 'X':
+			projecting = !projecting;
+			std::cout << "Position based springs: " << (projecting ? "on" : "off")
+				<< std::endl;
+			break;
 	}
 }
 
@@ -550,6 +762,26 @@ void MouseSpring::apply()
 	Spring::apply();
 }
 
+void MouseSpring::differentiate(const ParticleSystem &s, unit cx, unit cv,
+	const Vec *y, Vec *out)
+{
+	if (!target) return;
+	Spring::differentiate(s, cx, cv, y, out);
+}
+
+void MouseSpring::project(const Projection &p)
+{
+	if (!target) return;
+	Spring::project(p);
+}
+
+// Hooked to a rigid body, the spring pulls the dummy particle, whose force
+// the RigidForce hands on to the body; it has to stay a force for that.
+bool MouseSpring::projected() const
+{
+	return !rf->body;
+}
+
 void MouseSpring::hook(ParticleBase *p)
 {
 	target = p;
@@ -30,13 +30,13 @@ void RigidBox::draw()
 		glBindTexture(GL_TEXTURE_2D, (GLuint) tex->index);
 		glBegin(GL_QUADS);
 		glTexCoord2d(0.0, 0.0);
-		glVertex2dv(c00.data);
+		glVertex2dv(c00.data());
 		glTexCoord2d(0.0, 1.0);
-		glVertex2dv(c01.data);
+		glVertex2dv(c01.data());
 		glTexCoord2d(1.0, 1.0);
-		glVertex2dv(c11.data);
+		glVertex2dv(c11.data());
 		glTexCoord2d(1.0, 0.0);
-		glVertex2dv(c10.data);
+		glVertex2dv(c10.data());
 		glEnd();
 		glFlush();
 		glDisable(GL_TEXTURE_2D);
@@ -50,28 +50,28 @@ void RigidBox::draw()
 		
 		glBegin(GL_LINE_LOOP);
 		glColor3dv(color);
-		glVertex2dv(c00.data);
+		glVertex2dv(c00.data());
 		glColor3dv(color);
-		glVertex2dv(c01.data);
+		glVertex2dv(c01.data());
 		glColor3dv(color);
-		glVertex2dv(c11.data);
+		glVertex2dv(c11.data());
 		glColor3dv(color);
-		glVertex2dv(c10.data);
+		glVertex2dv(c10.data());
 		glEnd();
 		
 		glBegin(GL_LINES);
 		// Orientation
 		glColor3dv(blue);
-		glVertex2dv(rb->x->data);
-		glVertex2dv((*rb->x + Vec::fromAngle(*rb->o) * 0.1).data);
+		glVertex2dv(rb->x->data());
+		glVertex2dv((*rb->x + Vec::fromAngle(*rb->o) * 0.1).data());
 		// Angular velocity
 		//glColor3dv(green);
-		//glVertex2dv(rb->x->data);
-		//glVertex2dv((*rb->x + Vec::fromAngle(*rb->w) * 0.1).data);
+		//glVertex2dv(rb->x->data());
+		//glVertex2dv((*rb->x + Vec::fromAngle(*rb->w) * 0.1).data());
 		// Torque
 		//glColor3dv(red);
-		//glVertex2dv(rb->x->data);
-		//glVertex2dv((*rb->x + Vec::fromAngle(*rb->t) * 0.1).data);
+		//glVertex2dv(rb->x->data());
+		//glVertex2dv((*rb->x + Vec::fromAngle(*rb->t) * 0.1).data());
 		glEnd();
 	}
 	if (Fluid::VelocityMode)
@@ -79,8 +79,8 @@ void RigidBox::draw()
 		static const double cyan[3] = {0.0, 1.0, 1.0};
 		glBegin(GL_LINES);
 		glColor3dv(cyan);
-		glVertex2dv(rb->x->data);
-		glVertex2dv((*rb->x + *rb->v).data);
+		glVertex2dv(rb->x->data());
+		glVertex2dv((*rb->x + *rb->v).data());
 		glEnd();
 	}
 }
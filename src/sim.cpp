@@ -2,6 +2,7 @@
  * Simulation class -- See header file for more information. *
  *************************************************************/
 
+#include <algorithm>
 #include <ostream>
 #include <vector>
 
@@ -19,6 +20,9 @@ struct Simulation::Data
 	std::vector<ParticleBase *>particles;
 	std::vector<RigidBase *>rigids;
 	std::vector<Quad *>quads;
+	std::vector<Differentiable *> differentiables;
+	std::vector<Constraint *> constraints;
+	std::vector<Projectable *> projectables;
 	ParticleSystem system;
 	RigidSystem system2;
 	ParticleSystem cache;
@@ -50,6 +54,12 @@ void Simulation::manage(Entity *ent)
 		return;	
 	}
 	data->entities.push_back(ent);
+	if (dynamic_cast<Differentiable *> (ent))
+		data->differentiables.push_back(dynamic_cast<Differentiable *> (ent));
+	if (dynamic_cast<Constraint *> (ent))
+		data->constraints.push_back(dynamic_cast<Constraint *> (ent));
+	if (dynamic_cast<Projectable *> (ent))
+		data->projectables.push_back(dynamic_cast<Projectable *> (ent));
 	Quad *q = dynamic_cast<Quad *> (ent);
 	if (q)
 	{
@@ -140,7 +150,8 @@ RigidSystem &Simulation::getSystem2()
 	return data->system2;
 }
 
-void Simulation::calcForces()
+// Without projectables, forces an integrator solves as constraints are left out
+void Simulation::calcForces(bool projectables)
 {
 	// Reset forces
 	std::fill(data->system.f.begin(), data->system.f.end(), Vec());
@@ -148,8 +159,30 @@ void Simulation::calcForces()
 	std::fill(data->system2.t.begin(), data->system2.t.end(), 0.0);
 	// Apply forces
 	for (Entity *ent : data->entities)
-		if (dynamic_cast<Appliable *> (ent))
+	{
+		Projectable *p = projectables ? NULL : dynamic_cast<Projectable *> (ent);
+		if (dynamic_cast<Appliable *> (ent) && !(p && p->projected()))
 			dynamic_cast<Appliable *> (ent)->apply();
+	}
+}
+
+void Simulation::differentiate(unit cx, unit cv, const Vec *y, Vec *out)
+{
+	for (Differentiable *d : data->differentiables)
+		d->differentiate(data->system, cx, cv, y, out);
+}
+
+void Simulation::constrain(Vec *y)
+{
+	for (Constraint *c : data->constraints)
+		c->constrain(data->system, y);
+}
+
+void Simulation::project(const Projection &p)
+{
+	for (Projectable *c : data->projectables)
+		if (c->projected())
+			c->project(p);
 }
 
 void Simulation::saveState()
@@ -162,16 +195,18 @@ void Simulation::saveState()
 	data->cache2.w = data->system2.w;
 }
 
+// Copied back in place: the systems' buffers never move here, so the pointers
+// the entities hold into them stay valid and need no fixing up.
 void Simulation::restoreState()
 {
-	data->system.x = data->cache.x;
-	data->system.v = data->cache.v;
-	update_pointers();
-	data->system2.x = data->cache2.x;
-	data->system2.v = data->cache2.v;
-	data->system2.o = data->cache2.o;
-	data->system2.w = data->cache2.w;
-	update_pointers2();
+	ParticleSystem &s = data->system, &c = data->cache;
+	RigidSystem &s2 = data->system2, &c2 = data->cache2;
+	std::copy(c.x.begin(), c.x.end(), s.x.begin());
+	std::copy(c.v.begin(), c.v.end(), s.v.begin());
+	std::copy(c2.x.begin(), c2.x.end(), s2.x.begin());
+	std::copy(c2.v.begin(), c2.v.end(), s2.v.begin());
+	std::copy(c2.o.begin(), c2.o.end(), s2.o.begin());
+	std::copy(c2.w.begin(), c2.w.end(), s2.w.begin());
 }
 
 //------------------------------------------------------------------------------
@@ -187,6 +222,9 @@ void Simulation::clear()
 	data->rigids.push_back(NULL);
 	data->quads.clear();
 	data->quads.push_back(NULL);
+	data->differentiables.clear();
+	data->constraints.clear();
+	data->projectables.clear();
 	data->system = ParticleSystem();
 	data->cache = ParticleSystem();
 	data->system2 = RigidSystem();
@@ -206,7 +244,7 @@ void Simulation::draw()
 
 void Simulation::act(Integrator &intg, unit h)
 {
-	calcForces();
+	calcForces(!intg.projects());
 	for (Entity *ent : data->entities)
 		if (dynamic_cast<Actor *> (ent))
 			dynamic_cast<Actor *> (ent)->act(h);
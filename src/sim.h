@@ -21,6 +21,7 @@
 namespace Sim {
 
 class Integrator;
+class SpringNetwork;
 
 //------------------------------------------------------------------------------
 
@@ -39,6 +40,7 @@ public:
 	void clear();
 	
 	friend class Integrator;
+	friend class SpringNetwork;
 	virtual void act(Integrator &, unit h);
 	
 	ParticleBase **getParticles();
@@ -48,7 +50,10 @@ public:
 protected:
 	ParticleSystem &getSystem();
 	RigidSystem &getSystem2();
-	void calcForces();
+	void calcForces(bool projectables = true);
+	void differentiate(unit cx, unit cv, const Vec *y, Vec *out);
+	void constrain(Vec *y);
+	void project(const Projection &);
 	void saveState();
 	void restoreState();
 
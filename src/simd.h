@@ -0,0 +1,199 @@
+/*******************************************************
+ * SIMD primitives -- header file                      *
+ *                                                     *
+ * Authors: Ferry Timmers                              *
+ *                                                     *
+ * Date: 14:40 17-10-2026                              *
+ *                                                     *
+ * Description: Thin wrappers around SSE2 / AVX packs  *
+ *              of units or floats, with a scalar      *
+ *              fallback.                              *
+ *******************************************************/
+
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include "base.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Simd {
+
+using namespace Base;
+
+//------------------------------------------------------------------------------
+// A pack holds Width consecutive units. Build with -mavx (or -march=native)
+// to get 4-wide packs.
+
+#if defined(__AVX__)
+
+typedef __m256d pack;
+const int Width = 4;
+
+inline pack load(const unit *p) { return _mm256_loadu_pd(p); }
+inline void store(unit *p, pack a) { _mm256_storeu_pd(p, a); }
+inline pack set(unit s) { return _mm256_set1_pd(s); }
+inline pack add(pack a, pack b) { return _mm256_add_pd(a, b); }
+inline pack sub(pack a, pack b) { return _mm256_sub_pd(a, b); }
+inline pack mul(pack a, pack b) { return _mm256_mul_pd(a, b); }
+inline pack min(pack a, pack b) { return _mm256_min_pd(a, b); }
+inline pack max(pack a, pack b) { return _mm256_max_pd(a, b); }
+/** Rounded towards zero, as a cast to int does */
+inline pack trunc(pack a) { return _mm256_round_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+/** (0, 1, 2, 3) */
+inline pack ramp() { return _mm256_set_pd(3.0, 2.0, 1.0, 0.0); }
+/** Whole units to ints; k receives Width indices */
+inline void index(int *k, pack a) { _mm_storeu_si128((__m128i *) k, _mm256_cvttpd_epi32(a)); }
+inline pack load(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+inline void store(float *p, pack a) { _mm_storeu_ps(p, _mm256_cvtpd_ps(a)); }
+#if defined(__AVX2__)
+inline pack gather(const float *p, const int *k)
+	{ return _mm256_cvtps_pd(_mm_i32gather_ps(p, _mm_loadu_si128((const __m128i *) k), sizeof(float))); }
+inline pack gather(const unit *p, const int *k)
+	{ return _mm256_i32gather_pd(p, _mm_loadu_si128((const __m128i *) k), sizeof(unit)); }
+#else
+inline pack gather(const float *p, const int *k)
+	{ return _mm256_set_pd(p[k[3]], p[k[2]], p[k[1]], p[k[0]]); }
+inline pack gather(const unit *p, const int *k)
+	{ return _mm256_set_pd(p[k[3]], p[k[2]], p[k[1]], p[k[0]]); }
+#endif
+
+#elif defined(__SSE2__)
+
+typedef __m128d pack;
+const int Width = 2;
+
+inline pack load(const unit *p) { return _mm_loadu_pd(p); }
+inline void store(unit *p, pack a) { _mm_storeu_pd(p, a); }
+inline pack set(unit s) { return _mm_set1_pd(s); }
+inline pack add(pack a, pack b) { return _mm_add_pd(a, b); }
+inline pack sub(pack a, pack b) { return _mm_sub_pd(a, b); }
+inline pack mul(pack a, pack b) { return _mm_mul_pd(a, b); }
+inline pack min(pack a, pack b) { return _mm_min_pd(a, b); }
+inline pack max(pack a, pack b) { return _mm_max_pd(a, b); }
+inline pack trunc(pack a) { return _mm_cvtepi32_pd(_mm_cvttpd_epi32(a)); } // |a| < 2^31
+inline pack ramp() { return _mm_set_pd(1.0, 0.0); }
+inline void index(int *k, pack a) { _mm_storel_epi64((__m128i *) k, _mm_cvttpd_epi32(a)); }
+inline pack gather(const unit *p, const int *k) { return _mm_set_pd(p[k[1]], p[k[0]]); }
+inline pack load(const float *p) { return _mm_set_pd(p[1], p[0]); }
+inline void store(float *p, pack a)
+	{ _mm_store_ss(p, _mm_cvtpd_ps(a)); _mm_store_ss(p + 1, _mm_cvtpd_ps(_mm_unpackhi_pd(a, a))); }
+inline pack gather(const float *p, const int *k) { return _mm_set_pd(p[k[1]], p[k[0]]); }
+
+#else
+
+struct pack { unit x, y; };
+const int Width = 2;
+
+inline pack load(const unit *p) { return {p[0], p[1]}; }
+inline void store(unit *p, pack a) { p[0] = a.x; p[1] = a.y; }
+inline pack set(unit s) { return {s, s}; }
+inline pack add(pack a, pack b) { return {a.x + b.x, a.y + b.y}; }
+inline pack sub(pack a, pack b) { return {a.x - b.x, a.y - b.y}; }
+inline pack mul(pack a, pack b) { return {a.x * b.x, a.y * b.y}; }
+inline pack min(pack a, pack b) { return {b.x < a.x ? b.x : a.x, b.y < a.y ? b.y : a.y}; }
+inline pack max(pack a, pack b) { return {b.x > a.x ? b.x : a.x, b.y > a.y ? b.y : a.y}; }
+inline pack trunc(pack a) { return {(unit) (long long) a.x, (unit) (long long) a.y}; }
+inline pack ramp() { return {0.0, 1.0}; }
+inline void index(int *k, pack a) { k[0] = (int) a.x; k[1] = (int) a.y; }
+inline pack gather(const unit *p, const int *k) { return {p[k[0]], p[k[1]]}; }
+inline pack load(const float *p) { return {p[0], p[1]}; }
+inline void store(float *p, pack a) { p[0] = a.x; p[1] = a.y; }
+inline pack gather(const float *p, const int *k) { return {p[k[0]], p[k[1]]}; }
+
+#endif
+
+//------------------------------------------------------------------------------
+// Single precision packs, twice as wide. Kept apart from the unit packs above,
+// which widen floats on load, since the two can not be overloaded on return
+// type. Whole numbers are exact up to 2^24, which bounds the indices.
+
+namespace Single {
+
+#if defined(__AVX__)
+
+typedef __m256 pack;
+const int Width = 8;
+
+inline pack load(const float *p) { return _mm256_loadu_ps(p); }
+inline void store(float *p, pack a) { _mm256_storeu_ps(p, a); }
+inline pack set(float s) { return _mm256_set1_ps(s); }
+inline pack add(pack a, pack b) { return _mm256_add_ps(a, b); }
+inline pack sub(pack a, pack b) { return _mm256_sub_ps(a, b); }
+inline pack mul(pack a, pack b) { return _mm256_mul_ps(a, b); }
+inline pack min(pack a, pack b) { return _mm256_min_ps(a, b); }
+inline pack max(pack a, pack b) { return _mm256_max_ps(a, b); }
+inline pack trunc(pack a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+inline pack ramp() { return _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f); }
+inline void index(int *k, pack a) { _mm256_storeu_si256((__m256i *) k, _mm256_cvttps_epi32(a)); }
+#if defined(__AVX2__)
+inline pack gather(const float *p, const int *k)
+	{ return _mm256_i32gather_ps(p, _mm256_loadu_si256((const __m256i *) k), sizeof(float)); }
+#else
+inline pack gather(const float *p, const int *k)
+	{ return _mm256_set_ps(p[k[7]], p[k[6]], p[k[5]], p[k[4]], p[k[3]], p[k[2]], p[k[1]], p[k[0]]); }
+#endif
+
+#elif defined(__SSE2__)
+
+typedef __m128 pack;
+const int Width = 4;
+
+inline pack load(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, pack a) { _mm_storeu_ps(p, a); }
+inline pack set(float s) { return _mm_set1_ps(s); }
+inline pack add(pack a, pack b) { return _mm_add_ps(a, b); }
+inline pack sub(pack a, pack b) { return _mm_sub_ps(a, b); }
+inline pack mul(pack a, pack b) { return _mm_mul_ps(a, b); }
+inline pack min(pack a, pack b) { return _mm_min_ps(a, b); }
+inline pack max(pack a, pack b) { return _mm_max_ps(a, b); }
+inline pack trunc(pack a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); } // |a| < 2^31
+inline pack ramp() { return _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f); }
+inline void index(int *k, pack a) { _mm_storeu_si128((__m128i *) k, _mm_cvttps_epi32(a)); }
+inline pack gather(const float *p, const int *k) { return _mm_set_ps(p[k[3]], p[k[2]], p[k[1]], p[k[0]]); }
+
+#else
+
+struct pack { float x, y; };
+const int Width = 2;
+
+inline pack load(const float *p) { return {p[0], p[1]}; }
+inline void store(float *p, pack a) { p[0] = a.x; p[1] = a.y; }
+inline pack set(float s) { return {s, s}; }
+inline pack add(pack a, pack b) { return {a.x + b.x, a.y + b.y}; }
+inline pack sub(pack a, pack b) { return {a.x - b.x, a.y - b.y}; }
+inline pack mul(pack a, pack b) { return {a.x * b.x, a.y * b.y}; }
+inline pack min(pack a, pack b) { return {b.x < a.x ? b.x : a.x, b.y < a.y ? b.y : a.y}; }
+inline pack max(pack a, pack b) { return {b.x > a.x ? b.x : a.x, b.y > a.y ? b.y : a.y}; }
+inline pack trunc(pack a) { return {(float) (int) a.x, (float) (int) a.y}; }
+inline pack ramp() { return {0.0f, 1.0f}; }
+inline void index(int *k, pack a) { k[0] = (int) a.x; k[1] = (int) a.y; }
+inline pack gather(const float *p, const int *k) { return {p[k[0]], p[k[1]]}; }
+
+#endif
+
+} /* namespace Single */
+
+/** Flushes denormal results and inputs to zero while in scope. Decaying fields
+    otherwise spend much of their time in microcode assists, in particular in
+    single precision where denormals start at 1e-38. */
+struct FlushDenormals
+{
+#if defined(__SSE2__)
+	unsigned int csr;
+	FlushDenormals() : csr(_mm_getcsr()) { _mm_setcsr(csr | 0x8040); } // FTZ | DAZ
+	~FlushDenormals() { _mm_setcsr(csr); }
+#endif
+};
+
+//------------------------------------------------------------------------------
+
+} /* namespace Simd */
+
+#endif /* _SIMD_H */
+
+//..............................................................................
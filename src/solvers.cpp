@@ -0,0 +1,481 @@
+/***********************************************************
+ * Linear solvers -- See header file for more information. *
+ ***********************************************************/
+
+#include <math.h>
+#include <algorithm>
+
+#include "solvers.h"
+#include "threads.h"
+
+namespace Sim {
+
+#define IX(i,j) ((i)+(w+2)*(j))
+
+//------------------------------------------------------------------------------
+
+void set_bnd(int w, int h, int b, real *x)
+{
+	const int &W = w;
+	const int &H = h;
+	
+	if (b == 3)
+		return;
+	
+	for (int i = 1; i <= W; ++i)
+	{
+		x[IX(i, 0  )] = b >= 2 ? -x[IX(i, 1)] : x[IX(i, 1)];
+		x[IX(i, H+1)] = b >= 2 ? -x[IX(i, H)] : x[IX(i, H)];
+	}
+	for (int j = 1; j <= H; ++j)
+	{
+		x[IX(0  , j)] = b == 1 || b == 4 ? -x[IX(1, j)] : x[IX(1, j)];
+		x[IX(W+1, j)] = b == 1 || b == 4 ? -x[IX(W, j)] : x[IX(W, j)];
+	}
+	
+	x[IX(0  , 0  )] = 0.5 * (x[IX(1, 0  )] + x[IX(0  , 1)]);
+	x[IX(0  , H+1)] = 0.5 * (x[IX(1, H+1)] + x[IX(0  , H)]);
+	x[IX(W+1, 0  )] = 0.5 * (x[IX(W, 0  )] + x[IX(W+1, 1)]);
+	x[IX(W+1, H+1)] = 0.5 * (x[IX(W, H+1)] + x[IX(W+1, H)]);
+}
+
+//------------------------------------------------------------------------------
+
+/** r = x0 - A x over the interior, returns |r|^2 */
+unit residual(int w, int h, real *r, const real *x, const real *x0, unit a, unit c)
+{
+	unit sum = 0.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+		{
+			unit e = x0[IX(i, j)] - (c * x[IX(i, j)] - a * (x[IX(i - 1, j)]
+				+ x[IX(i + 1, j)] + x[IX(i, j - 1)] + x[IX(i, j + 1)]));
+			if (r) r[IX(i, j)] = e;
+			sum += e * e;
+		}
+	return sum;
+}
+
+static unit norm2(int w, int h, const real *x)
+{
+	unit sum = 0.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			sum += x[IX(i, j)] * x[IX(i, j)];
+	return sum;
+}
+
+// The sweeps take their coefficients as real, so that single precision grids
+// are also relaxed in single precision.
+
+/** Lexicographic Gauss-Seidel over cells i0 up to i1 of row j */
+static inline void sweep(int w, int j, int i0, int i1, real *x, const real *x0, real a, real c)
+{
+	for (int i = i0; i < i1; ++i)
+		x[IX(i, j)] = (x0[IX(i, j)] + a * (x[IX(i - 1, j)] + x[IX(i + 1, j)]
+			+ x[IX(i, j - 1)] + x[IX(i, j + 1)])) / c;
+}
+
+/** Gauss-Seidel over the cells with (i + j) % 2 == colour */
+static void relax(int w, int h, int colour, real *x, const real *x0, real a, real c)
+{
+	for (int j = 1; j <= h; ++j)
+		for (int i = 2 - ((j + colour) & 1); i <= w; i += 2)
+			x[IX(i, j)] = (x0[IX(i, j)] + a * (x[IX(i - 1, j)] + x[IX(i + 1, j)]
+				+ x[IX(i, j - 1)] + x[IX(i, j + 1)])) / c;
+}
+
+/** Over-relaxed version of the above, for rows j0 up to j1 */
+static void relax(int w, int j0, int j1, int colour, real *x, const real *x0, real a,
+	real c, real omega)
+{
+	for (int j = j0; j < j1; ++j)
+		for (int i = 2 - ((j + colour) & 1); i <= w; i += 2)
+		{
+			real gs = (x0[IX(i, j)] + a * (x[IX(i - 1, j)] + x[IX(i + 1, j)]
+				+ x[IX(i, j - 1)] + x[IX(i, j + 1)])) / c;
+			x[IX(i, j)] += omega * (gs - x[IX(i, j)]);
+		}
+}
+
+//------------------------------------------------------------------------------
+
+unit LinearSolver::residual(const real *x, const real *x0, unit a, unit c) const
+{
+	const int &w = width, &h = height;
+	unit r = Sim::residual(w, h, NULL, x, x0, a, c);
+	unit n = norm2(w, h, x0);
+	return n > 0.0 ? sqrt(r / n) : sqrt(r);
+}
+
+//------------------------------------------------------------------------------
+
+void GaussSeidelSolver::solve(int b, real *x, const real *x0, unit a, unit c)
+{
+	const int &w = width, &h = height;
+	stats.residual = -1.0;
+	for (int k = 0; k < iterations; k++)
+	{
+		if (cells)
+			for (const Span &s : *cells)
+				sweep(w, s.j, s.begin, s.end, x, x0, a, c);
+		else
+			for (int j = 1; j <= h; ++j)
+				sweep(w, j, 1, w + 1, x, x0, a, c);
+		set_bnd(w, h, b, x);
+		stats.iterations = k + 1;
+		if (tolerance > 0.0 && (stats.residual = residual(x, x0, a, c)) <= tolerance)
+			break;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+MultigridSolver::MultigridSolver(int w, int h, unit tol, int cycles)
+	: LinearSolver(w, h, cycles, tol), smooth(2)
+{
+	levels.emplace_back(w, h);
+	levels.back().r.resize((w + 2) * (h + 2), 0.0);
+	while ((w >= 8 && h >= 8) || (std::max(w, h) >= 16 && std::min(w, h) >= 2))
+	{
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		const size_t size = (w + 2) * (h + 2);
+		levels.emplace_back(w, h);
+		levels.back().x.resize(size, 0.0);
+		levels.back().rhs.resize(size, 0.0);
+		levels.back().r.resize(size, 0.0);
+	}
+}
+
+void MultigridSolver::solve(int b, real *x, const real *x0, unit a, unit c)
+{
+	stats.residual = -1.0;
+	for (int k = 0; k < iterations; ++k)
+	{
+		cycle(0, b, x, x0, a, c);
+		stats.iterations = k + 1;
+		if (tolerance > 0.0 && (stats.residual = residual(x, x0, a, c)) <= tolerance)
+			break;
+	}
+}
+
+void MultigridSolver::cycle(size_t l, int b, real *x, const real *x0, unit a, unit c)
+{
+	const int w = levels[l].w, h = levels[l].h;
+	
+	if (l + 1 == levels.size()) // Coarsest: just relax until about converged
+	{
+		for (int k = 0; k < 2 * (w + h); ++k)
+		{
+			relax(w, h, 0, x, x0, a, c);
+			set_bnd(w, h, b, x);
+			relax(w, h, 1, x, x0, a, c);
+			set_bnd(w, h, b, x);
+		}
+		return;
+	}
+	
+	for (int k = 0; k < smooth; ++k)
+	{
+		relax(w, h, 0, x, x0, a, c);
+		set_bnd(w, h, b, x);
+		relax(w, h, 1, x, x0, a, c);
+		set_bnd(w, h, b, x);
+	}
+	
+	// Restrict the residual: the sum of the (up to) four fine cells over four,
+	// also at the edge of odd sized grids. The coarse system then keeps the sum
+	// of the residual, without which it has no solution for mirrored borders.
+	real *r = levels[l].r.data();
+	Sim::residual(w, h, r, x, x0, a, c);
+	Level &C = levels[l + 1];
+	{
+		const int w = C.w;
+		std::fill(C.x.begin(), C.x.end(), 0.0);
+		for (int J = 1; J <= C.h; ++J)
+			for (int I = 1; I <= C.w; ++I)
+			{
+				unit sum = 0.0;
+				for (int j = 2 * J - 1; j <= 2 * J && j <= h; ++j)
+					for (int i = 2 * I - 1; i <= 2 * I && i <= levels[l].w; ++i)
+						sum += r[i + (levels[l].w + 2) * j];
+				C.rhs[IX(I, J)] = sum / 4;
+			}
+	}
+	
+	// The coarse operator is the same stencil at twice the spacing. The
+	// correction to fixed borders is zero on the walls between the cells.
+	cycle(l + 1, b == 3 ? 4 : b, C.x.data(), C.rhs.data(), a / 4.0, c - 3.0 * a);
+	
+	// Prolongate the correction, piecewise constant
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			x[IX(i, j)] += C.x[((i + 1) / 2) + (C.w + 2) * ((j + 1) / 2)];
+	set_bnd(w, h, b, x);
+	
+	for (int k = 0; k < smooth; ++k)
+	{
+		relax(w, h, 0, x, x0, a, c);
+		set_bnd(w, h, b, x);
+		relax(w, h, 1, x, x0, a, c);
+		set_bnd(w, h, b, x);
+	}
+}
+
+//------------------------------------------------------------------------------
+
+void RedBlackSolver::solve(int b, real *x, const real *x0, unit a, unit c)
+{
+	const int &w = width, &h = height;
+	
+	// Optimal factor from the spectral radius of the Jacobi iteration
+	unit o = omega;
+	if (o <= 0.0)
+	{
+		unit rho = (4.0 * a / c) * cos(Pi / (w > h ? w : h));
+		o = 2.0 / (1.0 + sqrt(1.0 - rho * rho));
+	}
+	
+	Threads::Pool *pool = parallel ? &Threads::pool() : NULL;
+	auto sweep = [&](int colour)
+	{
+		if (pool)
+			pool->parallel(h, [&](size_t begin, size_t end)
+				{ relax(w, begin + 1, end + 1, colour, x, x0, a, c, o); });
+		else
+			relax(w, 1, h + 1, colour, x, x0, a, c, o);
+		set_bnd(w, h, b, x);
+	};
+	
+	unit n = norm2(w, h, x0);
+	partial.resize(h + 2);
+	stats.residual = -1.0;
+	for (int k = 0; k < iterations; ++k)
+	{
+		sweep(0);
+		sweep(1);
+		stats.iterations = k + 1;
+		if (tolerance <= 0.0)
+			continue;
+		
+		auto rows = [&](size_t begin, size_t end)
+		{
+			// Row j is the single interior row of the grid starting at row j - 1
+			for (size_t j = begin + 1; j < end + 1; ++j)
+				partial[j] = Sim::residual(w, 1, NULL, x + (w + 2) * (j - 1), x0
+					+ (w + 2) * (j - 1), a, c);
+		};
+		if (pool)
+			pool->parallel(h, rows);
+		else
+			rows(0, h);
+		unit r = 0.0;
+		for (int j = 1; j <= h; ++j)
+			r += partial[j];
+		stats.residual = n > 0.0 ? sqrt(r / n) : sqrt(r);
+		if (stats.residual <= tolerance)
+			break;
+	}
+}
+
+//------------------------------------------------------------------------------
+
+ConjugateGradientSolver::ConjugateGradientSolver(int w, int h, unit tol, int it)
+	: LinearSolver(w, h, it, tol)
+{
+	const size_t size = (w + 2) * (h + 2);
+	r.resize(size, 0.0);
+	z.resize(size, 0.0);
+	s.resize(size, 0.0); // Borders of s stay zero, see multiply()
+	q.resize(size, 0.0);
+}
+
+const ConjugateGradientSolver::Preconditioner &ConjugateGradientSolver::factor(
+	int b, unit a, unit c)
+{
+	// One entry per border kind and per pressure or diffusion system, which
+	// is refactored when the coefficients change (diffusion's follow dt)
+	const bool poisson = c == 4 * a;
+	Preconditioner *slot = NULL;
+	for (Preconditioner &P : cache)
+		if (P.b == b && (P.c == 4 * P.a) == poisson)
+			slot = &P;
+	if (slot && slot->a == a && slot->c == c)
+		return *slot;
+	if (!slot)
+	{
+		cache.push_back(Preconditioner());
+		slot = &cache.back();
+	}
+	
+	const int &w = width, &h = height;
+	const unit tau = 0.97, sigma = 0.25; // Modification and safety factor
+	Preconditioner &P = *slot;
+	P.b = b;
+	P.a = a;
+	P.c = c;
+	P.diag.assign((w + 2) * (h + 2), 0.0);
+	P.inv.assign((w + 2) * (h + 2), 0.0);
+	
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+		{
+			// A mirrored border adds its neighbour back to the diagonal,
+			// a negated one (normal velocity) subtracts it, a fixed one
+			// leaves it and goes to the right hand side
+			unit d = c, m = b == 3 ? 0.0 : a;
+			if (i == 1) d += b == 1 ? m : -m;
+			if (i == w) d += b == 1 ? m : -m;
+			if (j == 1) d += b == 2 ? m : -m;
+			if (j == h) d += b == 2 ? m : -m;
+			P.diag[IX(i, j)] = d;
+			
+			// Off diagonals are -a between interior cells, 0 at borders
+			unit ax = i > 1 ? -a : 0.0, ay = j > 1 ? -a : 0.0;
+			unit pw = P.inv[IX(i - 1, j)], ps = P.inv[IX(i, j - 1)];
+			unit e = d - (ax * pw) * (ax * pw) - (ay * ps) * (ay * ps)
+				- tau * (ax * (j < h && i > 1 ? -a : 0.0) * pw * pw
+					+ ay * (i < w && j > 1 ? -a : 0.0) * ps * ps);
+			if (e < sigma * d)
+				e = d;
+			P.inv[IX(i, j)] = e > 0.0 ? 1.0 / sqrt(e) : 0.0;
+		}
+	return P;
+}
+
+/** z = (L L^T)^-1 r */
+void ConjugateGradientSolver::apply(const Preconditioner &P, const real *r, real *z)
+{
+	const int &w = width, &h = height;
+	const real a = P.a;
+	const real *inv = P.inv.data();
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+		{
+			real t = r[IX(i, j)];
+			if (i > 1) t += a * inv[IX(i - 1, j)] * z[IX(i - 1, j)];
+			if (j > 1) t += a * inv[IX(i, j - 1)] * z[IX(i, j - 1)];
+			z[IX(i, j)] = t * inv[IX(i, j)];
+		}
+	for (int j = h; j >= 1; --j)
+		for (int i = w; i >= 1; --i)
+		{
+			real t = z[IX(i, j)];
+			if (i < w) t += a * inv[IX(i, j)] * z[IX(i + 1, j)];
+			if (j < h) t += a * inv[IX(i, j)] * z[IX(i, j + 1)];
+			z[IX(i, j)] = t * inv[IX(i, j)];
+		}
+}
+
+/** q = A s, with the borders of s zero */
+void ConjugateGradientSolver::multiply(const Preconditioner &P, const real *s, real *q)
+{
+	const int &w = width, &h = height;
+	const real a = P.a;
+	const real *diag = P.diag.data();
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			q[IX(i, j)] = diag[IX(i, j)] * s[IX(i, j)] - a * (s[IX(i - 1, j)]
+				+ s[IX(i + 1, j)] + s[IX(i, j - 1)] + s[IX(i, j + 1)]);
+}
+
+void ConjugateGradientSolver::solve(int b, real *x, const real *x0, unit a, unit c)
+{
+	const int &w = width, &h = height;
+	const Preconditioner &P = factor(b, a, c);
+	const bool pressure = (c == 4.0 * a);
+	const size_t size = (w + 2) * (h + 2);
+	
+	// Initial guess, over the interior so that fixed borders stay
+	if (!pressure)
+		for (int j = 1; j <= h; ++j)
+			std::copy(x0 + IX(1, j), x0 + IX(w + 1, j), x + IX(1, j));
+	
+	// r = x0 - A x; the pure Neumann (pressure) system is singular, so its
+	// right hand side is projected onto the range: zero mean
+	std::copy(x, x + size, s.begin());
+	for (int i = 0; i <= w + 1; ++i)
+		s[IX(i, 0)] = s[IX(i, h + 1)] = 0.0;
+	for (int j = 0; j <= h + 1; ++j)
+		s[IX(0, j)] = s[IX(w + 1, j)] = 0.0;
+	multiply(P, s.data(), q.data());
+	unit mean = 0.0, bb = 0.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+		{
+			r[IX(i, j)] = x0[IX(i, j)] - q[IX(i, j)];
+			mean += x0[IX(i, j)];
+			bb += x0[IX(i, j)] * x0[IX(i, j)];
+		}
+	if (b == 3)
+	{
+		for (int i = 1; i <= w; ++i)
+		{
+			r[IX(i, 1)] += a * x[IX(i, 0)];
+			r[IX(i, h)] += a * x[IX(i, h + 1)];
+		}
+		for (int j = 1; j <= h; ++j)
+		{
+			r[IX(1, j)] += a * x[IX(0, j)];
+			r[IX(w, j)] += a * x[IX(w + 1, j)];
+		}
+	}
+	mean = pressure && b == 0 ? mean / (w * h) : 0.0;
+	bb = bb > 0.0 ? sqrt(bb) : 1.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+			r[IX(i, j)] -= mean;
+	
+	apply(P, r.data(), z.data());
+	unit rz = 0.0, rr = 0.0;
+	for (int j = 1; j <= h; ++j)
+		for (int i = 1; i <= w; ++i)
+		{
+			s[IX(i, j)] = z[IX(i, j)];
+			rz += r[IX(i, j)] * z[IX(i, j)];
+			rr += r[IX(i, j)] * r[IX(i, j)];
+		}
+	
+	stats.iterations = 0;
+	stats.residual = sqrt(rr) / bb;
+	while (stats.iterations < iterations && stats.residual > tolerance && rz != 0.0)
+	{
+		multiply(P, s.data(), q.data());
+		unit sq = 0.0;
+		for (int j = 1; j <= h; ++j)
+			for (int i = 1; i <= w; ++i)
+				sq += s[IX(i, j)] * q[IX(i, j)];
+		unit alpha = rz / sq;
+		rr = 0.0;
+		for (int j = 1; j <= h; ++j)
+			for (int i = 1; i <= w; ++i)
+			{
+				x[IX(i, j)] += alpha * s[IX(i, j)];
+				r[IX(i, j)] -= alpha * q[IX(i, j)];
+				rr += r[IX(i, j)] * r[IX(i, j)];
+			}
+		++stats.iterations;
+		stats.residual = sqrt(rr) / bb;
+		if (stats.residual <= tolerance)
+			break;
+		
+		apply(P, r.data(), z.data());
+		unit rz1 = 0.0;
+		for (int j = 1; j <= h; ++j)
+			for (int i = 1; i <= w; ++i)
+				rz1 += r[IX(i, j)] * z[IX(i, j)];
+		unit beta = rz1 / rz;
+		rz = rz1;
+		for (int j = 1; j <= h; ++j)
+			for (int i = 1; i <= w; ++i)
+				s[IX(i, j)] = z[IX(i, j)] + beta * s[IX(i, j)];
+	}
+	set_bnd(w, h, b, x);
+}
+
+//------------------------------------------------------------------------------
+
+} /* namespace Sim */
+
+//..............................................................................
@@ -0,0 +1,189 @@
+/*******************************************************
+ * Linear solvers -- header file                       *
+ *                                                     *
+ * Authors: Ferry Timmers                              *
+ *                                                     *
+ * Date: 18:10 17-10-2026                              *
+ *                                                     *
+ * Description: Solvers for the diffusion and pressure *
+ *              systems of the fluid simulation.       *
+ *******************************************************/
+
+#ifndef _SOLVERS_H
+#define _SOLVERS_H
+
+#include <vector>
+
+#include "base.h"
+
+namespace Sim {
+
+using namespace Base;
+
+//------------------------------------------------------------------------------
+// Scalar of the fluid grids. Build with -DFLUID_FLOAT (make DEFS=-DFLUID_FLOAT)
+// to store them in single precision; coefficients, sums and everything outside
+// the fluid stay in unit.
+
+#ifdef FLUID_FLOAT
+typedef float real;
+#else
+typedef unit real;
+#endif
+
+//------------------------------------------------------------------------------
+
+/** Run of interior cells [begin, end) of row j */
+struct Span
+{
+	int j, begin, end;
+};
+typedef std::vector<Span> Spans;
+
+//------------------------------------------------------------------------------
+
+/** Sets the border cells of a (w+2) x (h+2) grid: mirrored, with the normal
+    component negated for b = 1 (x) and b = 2 (y), or all negated for b = 4.
+    For b = 3 the borders are fixed values, left as they are. */
+void set_bnd(int w, int h, int b, real *x);
+
+//------------------------------------------------------------------------------
+
+/** Solves c x - a (x[i-1,j] + x[i+1,j] + x[i,j-1] + x[i,j+1]) = x0 over the
+    interior of a (width+2) x (height+2) grid, with borders as set_bnd(b). */
+class LinearSolver
+{
+public:
+	struct Stats
+	{
+		int iterations;
+		unit residual; // Relative: |x0 - A x| / |x0|, < 0 if not measured
+	};
+	
+	const int width, height;
+	int iterations; // Maximum
+	unit tolerance; // Relative residual to stop at, 0 runs all iterations
+	Stats stats; // Of the last solve
+	const Spans *cells; // If set, only update these, by row (Gauss-Seidel only)
+	
+	LinearSolver(int w, int h, int it, unit tol)
+		: width(w), height(h), iterations(it), tolerance(tol), stats({0, -1.0}),
+		cells(NULL) {}
+	virtual ~LinearSolver() {}
+	
+	virtual const char *name() const = 0;
+	virtual void solve(int b, real *x, const real *x0, unit a, unit c) = 0;
+	/** A solver of the same kind and settings for a w x h grid */
+	virtual LinearSolver *resized(int w, int h) const = 0;
+	
+	/** Relative residual of x, computed over the interior */
+	unit residual(const real *x, const real *x0, unit a, unit c) const;
+};
+
+//------------------------------------------------------------------------------
+
+/** Lexicographic Gauss-Seidel; 20 sweeps without tolerance, as by Stam */
+class GaussSeidelSolver : public LinearSolver
+{
+public:
+	GaussSeidelSolver(int w, int h, int it = 20, unit tol = 0.0)
+		: LinearSolver(w, h, it, tol) {}
+	
+	const char *name() const { return "Gauss-Seidel"; }
+	void solve(int b, real *x, const real *x0, unit a, unit c);
+	LinearSolver *resized(int w, int h) const
+		{ return new GaussSeidelSolver(w, h, iterations, tolerance); }
+};
+
+//------------------------------------------------------------------------------
+
+/** Geometric multigrid; V-cycles with red-black Gauss-Seidel smoothing,
+    cell centred coarsening until the grid is a few cells wide. */
+class MultigridSolver : public LinearSolver
+{
+public:
+	int smooth; // Pre and post smoothing sweeps per level
+	
+	MultigridSolver(int w, int h, unit tol = 1e-4, int cycles = 20);
+	
+	const char *name() const { return "Multigrid"; }
+	void solve(int b, real *x, const real *x0, unit a, unit c);
+	LinearSolver *resized(int w, int h) const
+		{ MultigridSolver *s = new MultigridSolver(w, h, tolerance, iterations);
+		  s->smooth = smooth; return s; }
+
+private:
+	struct Level
+	{
+		int w, h;
+		std::vector<real> x, rhs, r;
+		
+		Level(int w, int h) : w(w), h(h) {}
+	};
+	std::vector<Level> levels;
+	
+	void cycle(size_t l, int b, real *x, const real *x0, unit a, unit c);
+};
+
+//------------------------------------------------------------------------------
+
+/** Red-black ordered successive over-relaxation. Cells of one colour only
+    depend on the other colour, so each half sweep runs in parallel over
+    blocks of rows. With omega 0 the optimal factor for the system is used. */
+class RedBlackSolver : public LinearSolver
+{
+public:
+	unit omega;
+	bool parallel;
+	
+	RedBlackSolver(int w, int h, unit _omega = 0.0, unit tol = 1e-4, int it = 100)
+		: LinearSolver(w, h, it, tol), omega(_omega), parallel(true) {}
+	
+	const char *name() const { return "Red-black SOR"; }
+	void solve(int b, real *x, const real *x0, unit a, unit c);
+	LinearSolver *resized(int w, int h) const
+		{ RedBlackSolver *s = new RedBlackSolver(w, h, omega, tolerance, iterations);
+		  s->parallel = parallel; return s; }
+
+private:
+	std::vector<unit> partial; // Squared residual per row
+};
+
+//------------------------------------------------------------------------------
+
+/** Matrix free conjugate gradients, preconditioned with modified incomplete
+    Cholesky, MIC(0). Borders enter the matrix as changes to the diagonal.
+    The pressure system (c = 4a) starts from x as given, other systems from
+    their right hand side. */
+class ConjugateGradientSolver : public LinearSolver
+{
+public:
+	ConjugateGradientSolver(int w, int h, unit tol = 1e-4, int it = 200);
+	
+	const char *name() const { return "Conjugate gradient"; }
+	void solve(int b, real *x, const real *x0, unit a, unit c);
+	LinearSolver *resized(int w, int h) const
+		{ return new ConjugateGradientSolver(w, h, tolerance, iterations); }
+
+private:
+	struct Preconditioner
+	{
+		int b;
+		unit a, c;
+		std::vector<real> diag, inv; // Matrix diagonal, 1 / factor diagonal
+	};
+	std::vector<Preconditioner> cache; // One per kind of system, they alternate
+	std::vector<real> r, z, s, q;
+	
+	const Preconditioner &factor(int b, unit a, unit c);
+	void apply(const Preconditioner &, const real *r, real *z);
+	void multiply(const Preconditioner &, const real *s, real *q);
+};
+
+//------------------------------------------------------------------------------
+
+} /* namespace Sim */
+
+#endif /* _SOLVERS_H */
+
+//..............................................................................
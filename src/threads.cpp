@@ -0,0 +1,129 @@
+/********************************************************
+ * Thread pool -- See header file for more information. *
+ ********************************************************/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "threads.h"
+
+namespace Threads {
+
+//------------------------------------------------------------------------------
+
+struct Pool::Data
+{
+	std::vector<std::thread> workers;
+	unsigned threads;
+	std::mutex lock;
+	std::condition_variable start, done;
+	const Task *task;
+	size_t n;
+	unsigned long generation;
+	unsigned pending;
+	bool quit;
+};
+
+//------------------------------------------------------------------------------
+
+Pool::Pool(unsigned threads) : data(new Data)
+{
+	if (!threads)
+		threads = std::thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+	data->threads = threads;
+	data->task = NULL;
+	data->n = 0;
+	data->generation = 0;
+	data->pending = 0;
+	data->quit = false;
+	for (unsigned i = 1; i < threads; ++i)
+		data->workers.push_back(std::thread(&Pool::work, this, i));
+}
+
+Pool::~Pool()
+{
+	{
+		std::lock_guard<std::mutex> guard(data->lock);
+		data->quit = true;
+	}
+	data->start.notify_all();
+	for (std::thread &t : data->workers)
+		t.join();
+	delete data;
+}
+
+unsigned Pool::size() const
+{
+	return data->threads;
+}
+
+//------------------------------------------------------------------------------
+
+void Pool::parallel(size_t n, const Task &task)
+{
+	const unsigned threads = size();
+	if (threads == 1 || n < threads)
+	{
+		task(0, n);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(data->lock);
+		data->task = &task;
+		data->n = n;
+		data->pending = threads - 1;
+		++data->generation;
+	}
+	data->start.notify_all();
+	
+	task(0, n / threads);
+	
+	std::unique_lock<std::mutex> guard(data->lock);
+	data->done.wait(guard, [this]() { return data->pending == 0; });
+	data->task = NULL;
+}
+
+void Pool::work(unsigned index)
+{
+	const size_t threads = size();
+	unsigned long seen = 0;
+	for (;;)
+	{
+		const Task *task;
+		size_t n;
+		{
+			std::unique_lock<std::mutex> guard(data->lock);
+			data->start.wait(guard, [&]()
+				{ return data->quit || data->generation != seen; });
+			if (data->quit)
+				return;
+			seen = data->generation;
+			task = data->task;
+			n = data->n;
+		}
+		
+		(*task)(n * index / threads, n * (index + 1) / threads);
+		
+		std::lock_guard<std::mutex> guard(data->lock);
+		if (--data->pending == 0)
+			data->done.notify_one();
+	}
+}
+
+//------------------------------------------------------------------------------
+
+Pool &pool()
+{
+	static Pool shared;
+	return shared;
+}
+
+//------------------------------------------------------------------------------
+
+} /* namespace Threads */
+
+//..............................................................................
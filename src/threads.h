@@ -0,0 +1,52 @@
+/*******************************************************
+ * Thread pool -- header file                          *
+ *                                                     *
+ * Authors: Ferry Timmers                              *
+ *                                                     *
+ * Date: 16:05 17-10-2026                              *
+ *                                                     *
+ * Description: Fixed pool of worker threads running   *
+ *              data parallel loops.                   *
+ *******************************************************/
+
+#ifndef _THREADS_H
+#define _THREADS_H
+
+#include <stddef.h>
+#include <functional>
+
+namespace Threads {
+
+//------------------------------------------------------------------------------
+
+class Pool
+{
+public:
+	/** Body of a parallel loop, called with a half open range [begin, end) */
+	typedef std::function<void (size_t begin, size_t end)> Task;
+	
+	Pool(unsigned threads = 0); // 0: one per hardware thread
+	~Pool();
+	
+	unsigned size() const;
+	
+	/** Splits [0, n) into one contiguous block per thread and runs task on
+	    each; returns when all blocks are done. The caller runs a block too. */
+	void parallel(size_t n, const Task &task);
+
+private:
+	void work(unsigned index);
+	struct Data;
+	Data *data;
+};
+
+/** Pool shared by the simulation */
+Pool &pool();
+
+//------------------------------------------------------------------------------
+
+} /* namespace Threads */
+
+#endif /* _THREADS_H */
+
+//..............................................................................